@@ -20,140 +20,833 @@
 //  2021: modified by @poruruba
 
 #include "ESP32FtpServer.h"
+#include "FtpLz.h"
 
 #include <WiFi.h>
 #include <WiFiClient.h>
+#include <lwip/sockets.h>
+#include <stdarg.h>
+#ifdef FTP_WAIT_EPOLL
+#include <sys/epoll.h>
+#endif
+#if FTP_ENABLE_TLS
+#include <mbedtls/version.h>
+#include <mbedtls/net_sockets.h>
+#endif
+
+unsigned long FtpServer::rateGlobal = FTP_RATE_LIMIT;
+uint32_t FtpServer::ratePeriod;
+uint32_t FtpServer::millisRatePeriod;
+uint8_t FtpServer::rateUsers;
+uint8_t FtpServer::rateUsersLast;
+
+FtpServer::FtpServer(uint16_t ctrl_port, uint16_t pasv_port)
+  : ctrlServer( ctrl_port ), dataServer( pasv_port ), ctrlPort( ctrl_port ), pasvPort( pasv_port ){
+  rateSharePeriod = ratePeriod - 1;
+#ifdef FTP_WAIT_EPOLL
+  epollFd = -1;
+  epollListen = -1;
+#endif
+#if FTP_ENABLE_TLS
+  tlsReady = false;
+#endif
+}
+
+void FtpServer::client_println(const char *text){
+  client_printf("%s", text);
+}
 
-WiFiServer ftpServer( FTP_CTRL_PORT );
-WiFiServer dataServer( FTP_DATA_PORT_PASV );
+// Format a reply line on the stack, so that no String is built, and send it
+// with its CR/LF in one write (one TLS record when the connection is secured)
 
-void FtpServer::client_println(String text){
+void FtpServer::client_printf(const char *format, ...){
+  char line[ FTP_LINE_SIZE ];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line, sizeof(line) - 2, format, args);
+  va_end(args);
+  if( n < 0 )
+    n = 0;
+  else if( n > (int) sizeof(line) - 3 )
+    n = sizeof(line) - 3;
 #ifdef FTP_DEBUG
-  Serial.println(String("(ctrl) ") + text);
+  Serial.printf("(ctrl) %s\n", line);
+#endif
+#ifdef FTP_TRACE
+  trace(T_CTRL_OUT, line, n);
+#endif
+  line[ n++ ] = '\r';
+  line[ n++ ] = '\n';
+#if FTP_ENABLE_TLS
+  if( ctrlTls == TLS_ON ){
+    tlsWrite( &ctrlSsl, ctrlFd, line, n );
+    return;
+  }
 #endif
-  client.println(text);
+  client.write((const uint8_t*) line, n);
 }
 
-void FtpServer::data_println(String text){
+void FtpServer::data_println(const char *text){
+  data_printf("%s", text);
+}
+
+void FtpServer::data_printf(const char *format, ...){
+  char line[ FTP_LINE_SIZE ];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line, sizeof(line) - 2, format, args);
+  va_end(args);
+  if( n < 0 )
+    n = 0;
+  else if( n > (int) sizeof(line) - 3 )
+    n = sizeof(line) - 3;
 #ifdef FTP_DEBUG
-  Serial.println(String("(data) ") + text);
+  Serial.printf("(data) %s\n", line);
+#endif
+  line[ n++ ] = '\r';
+  line[ n++ ] = '\n';
+  dataWrite(line, n);
+}
+
+#if FTP_ENABLE_TLS
+// Socket I/O of the TLS contexts. Reading never waits, so that handleFTP()
+// doesn't either; writing may, as WiFiClient::write() does.
+
+static int tlsSend( void *ctx, const unsigned char *buf, size_t len ){
+  int r = send( *(int*) ctx, buf, len, MSG_NOSIGNAL );
+  if( r >= 0 )
+    return r;
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+static int tlsRecv( void *ctx, unsigned char *buf, size_t len ){
+  int r = recv( *(int*) ctx, buf, len, MSG_DONTWAIT );
+  if( r > 0 )
+    return r;
+  if( r == 0 )
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+}
 #endif
-  data.println(text);
+
+boolean FtpServer::begin(unsigned char *p_buffer, unsigned long length){
+  return begin("anonymous", "", p_buffer, length);
 }
 
-void FtpServer::begin(unsigned char *p_buffer, unsigned long length){
-  begin("anonymous", "", p_buffer, length);
+boolean FtpServer::begin(const String &uname, const String &pword, unsigned char *p_buffer, unsigned long length){
+  return begin(uname.c_str(), pword.c_str(), p_buffer, length);
 }
 
-void FtpServer::begin(String uname, String pword, unsigned char *p_buffer, unsigned long length){
+boolean FtpServer::begin(const char *uname, const char *pword, unsigned char *p_buffer, unsigned long length){
+  // a truncated name or password would let a shorter one log in
+  if( strlen( uname ) >= sizeof(_FTP_USER) || strlen( pword ) >= sizeof(_FTP_PASS) )
+    return false;
+
   file_buffer = p_buffer;
   file_buffer_length = length;
 
   // Tells the ftp server to begin listening for incoming connection
-  _FTP_USER = uname;
-  _FTP_PASS = pword;
+  strcpy( _FTP_USER, uname );
+  strcpy( _FTP_PASS, pword );
 
-  ftpServer.begin();
+  ctrlServer.begin();
   delay(10);
   dataServer.begin();	
   delay(10);
   millisTimeOut = (uint32_t)FTP_TIME_OUT * 60 * 1000;
   millisDelay = 0;
-  cmdStatus = 0;
+  cmdStatus = C_DISCONNECT;
+  rateSession = 0;
+  activeFd = -1;
+#ifdef FTP_STATS
+  resetStats();
+#endif
+#ifdef FTP_TRACE
+  traceOut = NULL;
+#endif
 
   file_name[0] = '\0';
   file_buffer_size = 0;
+  file_compressed = false;
+  compression = false;
+  readCursor.data = retrCursor.data = NULL;
+  roFileCount = 0;
+#if FTP_ENABLE_TAR
+  tarCount = 0;
+#endif
+#if FTP_ENABLE_SNAPSHOT
+  snapActive = false;
+  snapBuffer = NULL;
+  snapBufferLength = 0;
+#endif
 	
   iniVariables();
+  return true;
 }
 
 void FtpServer::iniVariables(){
   // Default for data port
-  dataPort = FTP_DATA_PORT_PASV;
+  dataPort = pasvPort;
   
-  // Default Data connection is Active
+  // Default Data connection is Passive
   dataPassiveConn = true;
+  closeActive();
+  activeAgain = false;
   
   // Set the root directory
   strcpy( cwdName, "/" );
 
+#if FTP_ENABLE_RENAME
   rnfrCmd = false;
+#endif
+  restartOffset = 0;
+  rateClient = 0;
+  dataWait = false;
+  dataCommand = D_NONE;
   transferStatus = F_IDLE;  
+#if FTP_ENABLE_TLS
+  ctrlTls = TLS_OFF;
+  dataTls = TLS_OFF;
+  dataProt = false;
+#endif
 }
 
 void FtpServer::setFile(const char *fname, unsigned long size){
   strcpy( file_name, fname );
   file_buffer_size = size;
+  file_compressed = false;
+  readCursor.data = retrCursor.data = NULL;
   getLocalTime(&file_timeInfo);
 }
 
-FTP_F_STATUS FtpServer::handleFTP(){
+#if FTP_ENABLE_COMPRESS
+void FtpServer::setCompression(boolean enable){
+  compression = enable;
+}
+#endif
+
+#if FTP_ENABLE_SNAPSHOT
+void FtpServer::setSnapshotBuffer(unsigned char *p_buffer, unsigned long length){
+  snapBuffer = p_buffer;
+  snapBufferLength = length;
+}
+
+boolean FtpServer::snapshot(const char *name){
+  if( snapActive || file_name[0] == '\0' )
+    return false;
+  // the stored file must fit in the snapshot buffer, so that it can be
+  // overwritten later
+  unsigned long stored = file_compressed ? file_stored_size : file_buffer_size;
+  if( snapBuffer == NULL || stored > snapBufferLength )
+    return false;
+  if( name[0] == '\0' || strchr( name, '/' ) != NULL || strlen( name ) >= FTP_SNAP_NAME_SIZE )
+    return false;
+
+  snprintf( snap.path, sizeof(snap.path), FTP_SNAP_DIR "%s%s", name, file_name );
+  snap.data = file_buffer;
+  snap.size = file_buffer_size;
+  snap.stored = stored;
+  snap.compressed = file_compressed;
+  snap.timeInfo = file_timeInfo;
+  snapActive = true;
+
+  return true;
+}
+
+boolean FtpServer::releaseSnapshot(){
+  if( ! snapActive )
+    return false;
+  if( transferStatus == F_RETRIEVED && ( retrFile.name == snap.path || retrFile.archive ))
+    abortTransfer();
+  snapActive = false;
+  return true;
+}
+#endif
+
+boolean FtpServer::prepareWrite(unsigned long offset){
+  // a RETR sends the stored file in place
+  if( isBusy() )
+    return false;
+#if FTP_ENABLE_SNAPSHOT
+  if( snapActive && snap.data == file_buffer && offset < snap.stored ){
+    // copy on write
+    if( snapBuffer == NULL || snap.stored > snapBufferLength )
+      return false;
+    memcpy( snapBuffer, file_buffer, snap.stored );
+    snap.data = snapBuffer;
+    readCursor.data = retrCursor.data = NULL;
+    if( transferStatus == F_RETRIEVED && retrFile.name == snap.path )
+      retrFile.data = snapBuffer;
+#if FTP_ENABLE_TAR
+    for( uint8_t i = 0; i < tarCount; i++ )
+      if( tarFiles[i].name == snap.path )
+        tarFiles[i].data = snapBuffer;
+#endif
+  }
+#else
+  (void) offset;
+#endif
+  return true;
+}
+
+unsigned long FtpServer::readFile(unsigned long offset, unsigned char *dst, unsigned long length){
+  FTP_FILE file;
+  if( file_name[0] == '\0' || ! getFile( 0, &file ))
+    return 0;
+  return readFileData( &file, offset, dst, length, &readCursor );
+}
+
+boolean FtpServer::addReadOnlyFile(const char *fname, const unsigned char *data, unsigned long size){
+  if( roFileCount >= FTP_MAX_ROFILES )
+    return false;
+
+  FTP_ROFILE *ro = &roFiles[ roFileCount ];
+  // names are kept as absolute paths, like those made by makePath()
+  if( fname[0] == '/' ){
+    if( strlen( fname ) >= sizeof(ro->name) )
+      return false;
+    strcpy( ro->name, fname );
+  }else{
+    if( strlen( fname ) + 1 >= sizeof(ro->name) )
+      return false;
+    ro->name[0] = '/';
+    strcpy( &ro->name[1], fname );
+  }
+  FTP_FILE file;
+  if( findFile( ro->name, &file ))
+    return false;
+
+  ro->data = data;
+  ro->size = size;
+  getLocalTime(&ro->timeInfo);
+  roFileCount++;
+
+  return true;
+}
+
+boolean FtpServer::removeReadOnlyFile(const char *fname){
+  for( uint8_t i = 0; i < roFileCount; i++ ){
+    const char *name = roFiles[i].name;
+    if( strcmp( name, fname ) == 0 || ( fname[0] != '/' && strcmp( name + 1, fname ) == 0 )){
+      if( transferStatus == F_RETRIEVED && ( retrFile.data == roFiles[i].data || retrFile.archive ))
+        abortTransfer();
+      memmove( &roFiles[i], &roFiles[i + 1], ( roFileCount - i - 1 ) * sizeof(FTP_ROFILE) );
+      roFileCount--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void FtpServer::setGlobalRateLimit(unsigned long bytesPerSec){
+  rateGlobal = bytesPerSec;
+}
+
+void FtpServer::setRateLimit(unsigned long bytesPerSec){
+  rateSession = bytesPerSec;
+}
+
+#if FTP_ENABLE_TLS
+boolean FtpServer::setCertificate(const char *cert_pem, const char *key_pem, boolean required){
+  if( tlsReady )
+    return false;
+
+  mbedtls_entropy_init( &tlsEntropy );
+  mbedtls_ctr_drbg_init( &tlsDrbg );
+  mbedtls_x509_crt_init( &tlsCert );
+  mbedtls_pk_init( &tlsKey );
+  mbedtls_ssl_config_init( &tlsConf );
+#if defined(MBEDTLS_SSL_TICKET_C)
+  mbedtls_ssl_ticket_init( &tlsTicket );
+#endif
+  mbedtls_ssl_init( &ctrlSsl );
+  mbedtls_ssl_init( &dataSsl );
+
+  // PEM buffers are parsed with their terminating NUL
+  boolean ok = mbedtls_ctr_drbg_seed( &tlsDrbg, mbedtls_entropy_func, &tlsEntropy, (const unsigned char*) "ftp", 3 ) == 0
+    && mbedtls_x509_crt_parse( &tlsCert, (const unsigned char*) cert_pem, strlen( cert_pem ) + 1 ) == 0
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    && mbedtls_pk_parse_key( &tlsKey, (const unsigned char*) key_pem, strlen( key_pem ) + 1, NULL, 0, mbedtls_ctr_drbg_random, &tlsDrbg ) == 0
+#else
+    && mbedtls_pk_parse_key( &tlsKey, (const unsigned char*) key_pem, strlen( key_pem ) + 1, NULL, 0 ) == 0
+#endif
+    && mbedtls_ssl_config_defaults( &tlsConf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT ) == 0
+    && mbedtls_ssl_conf_own_cert( &tlsConf, &tlsCert, &tlsKey ) == 0;
+  if( ok ){
+    mbedtls_ssl_conf_rng( &tlsConf, mbedtls_ctr_drbg_random, &tlsDrbg );
+#if defined(MBEDTLS_SSL_TICKET_C)
+    // data connections resume the session of the control connection
+    ok = mbedtls_ssl_ticket_setup( &tlsTicket, mbedtls_ctr_drbg_random, &tlsDrbg, MBEDTLS_CIPHER_AES_128_GCM, FTP_TLS_TICKET_LIFETIME ) == 0;
+    mbedtls_ssl_conf_session_tickets_cb( &tlsConf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &tlsTicket );
+#endif
+  }
+  ok = ok && mbedtls_ssl_setup( &ctrlSsl, &tlsConf ) == 0 && mbedtls_ssl_setup( &dataSsl, &tlsConf ) == 0;
+  if( ! ok ){
+    mbedtls_ssl_free( &dataSsl );
+    mbedtls_ssl_free( &ctrlSsl );
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free( &tlsTicket );
+#endif
+    mbedtls_ssl_config_free( &tlsConf );
+    mbedtls_pk_free( &tlsKey );
+    mbedtls_x509_crt_free( &tlsCert );
+    mbedtls_ctr_drbg_free( &tlsDrbg );
+    mbedtls_entropy_free( &tlsEntropy );
+    return false;
+  }
+  mbedtls_ssl_set_bio( &ctrlSsl, &ctrlFd, tlsSend, tlsRecv, NULL );
+  mbedtls_ssl_set_bio( &dataSsl, &dataFd, tlsSend, tlsRecv, NULL );
+  tlsRequired = required;
+  tlsReady = true;
+  return true;
+}
+#endif
+
+#ifdef FTP_STATS
+void FtpServer::resetStats(){
+  memset( &stats, 0, sizeof(stats) );
+  stats.millisBegin = millis();
+}
+
+void FtpServer::printStats(Print &out){
+  char line[ 512 ];
+  snprintf( line, sizeof(line),
+    "{\"millis\":%lu,\"connections\":%lu,\"replaced\":%lu,\"dataRefused\":%lu,"
+    "\"commands\":%lu,\"cmdP50us\":%lu,\"cmdP99us\":%lu,\"cmdP999us\":%lu,"
+    "\"dataConnects\":%lu,\"dataConnectMillis\":%lu,\"bytesSent\":%lu,\"bytesReceived\":%lu,"
+    "\"callP50us\":%lu,\"callP99us\":%lu,\"callMaxus\":%lu}",
+    (unsigned long)( millis() - stats.millisBegin ), (unsigned long) stats.connections,
+    (unsigned long) stats.replaced, (unsigned long) stats.dataRefused, (unsigned long) stats.commands,
+    (unsigned long) histPercentile( stats.cmdHist, 500 ), (unsigned long) histPercentile( stats.cmdHist, 990 ),
+    (unsigned long) histPercentile( stats.cmdHist, 999 ), (unsigned long) stats.dataConnects,
+    (unsigned long) stats.dataConnectMillis, (unsigned long) stats.bytesSent, (unsigned long) stats.bytesReceived,
+    (unsigned long) histPercentile( stats.callHist, 500 ), (unsigned long) histPercentile( stats.callHist, 990 ),
+    (unsigned long) histPercentile( stats.callHist, 1000 ) );
+  out.println( line );
+}
+
+// Count value in a histogram of FTP_HIST_BUCKETS power of 2 buckets
+
+void FtpServer::histAdd(uint32_t *hist, uint32_t value){
+  uint8_t i = 0;
+  while( value > 0 && i < FTP_HIST_BUCKETS - 1 ){
+    value >>= 1;
+    i++;
+  }
+  hist[ i ]++;
+}
+
+// Upper bound of the bucket holding the given percentile (in 1/1000)
+
+uint32_t FtpServer::histPercentile(const uint32_t *hist, uint32_t permille){
+  uint32_t total = 0;
+  for( uint8_t i = 0; i < FTP_HIST_BUCKETS; i++ )
+    total += hist[ i ];
+  if( total == 0 )
+    return 0;
+
+  uint32_t rank = (uint32_t)( ( (uint64_t) total * permille + 999 ) / 1000 );
+  uint32_t count = 0;
+  for( uint8_t i = 0; i < FTP_HIST_BUCKETS; i++ ){
+    count += hist[ i ];
+    if( count >= rank )
+      return ( 1UL << i ) - 1;
+  }
+  return ( 1UL << ( FTP_HIST_BUCKETS - 1 )) - 1;
+}
+#endif
+
+#ifdef FTP_TRACE
+void FtpServer::setTrace(Print *out){
+  traceOut = out;
+  microsTraceBegin = micros();
+}
+
+void FtpServer::trace(FTP_T_TYPE type, const void *payload, uint16_t length){
+  if( traceOut == NULL )
+    return;
+
+  uint32_t t = micros() - microsTraceBegin;
+  uint8_t header[ FTP_TRACE_HEADER_SIZE ];
+  header[0] = type;
+  header[1] = t & 0xff;
+  header[2] = ( t >> 8 ) & 0xff;
+  header[3] = ( t >> 16 ) & 0xff;
+  header[4] = ( t >> 24 ) & 0xff;
+  header[5] = length & 0xff;
+  header[6] = ( length >> 8 ) & 0xff;
+  traceOut->write(header, sizeof(header));
+  if( length > 0 )
+    traceOut->write((const uint8_t*) payload, length);
+}
+#endif
+
+FTP_F_STATUS FtpServer::handleFTP( uint32_t budget_us ){
+  uint32_t microsBegin = micros();
+  FTP_F_STATUS status;
+
+  // go on while there is work and time left, but return at once any
+  // event the application has to see
+  do{
+    status = handleStep();
+  }while( status == F_IDLE && budget_us > 0 && hasWork() && micros() - microsBegin < budget_us );
+
+#ifdef FTP_STATS
+  histAdd( stats.callHist, micros() - microsBegin );
+#endif
+  return status;
+}
+
+// true if handleStep() has something to do right now
+
+boolean FtpServer::hasWork(){
+  if((int32_t) ( millisDelay - millis() ) > 0 )
+    return false;
+  if( cmdStatus < C_IDLE || ctrlServer.hasClient() )
+    return true;
+  if( dataWait ){
+    if( millis() - millisDataWait >= 10000 || data.connected() || ctrlAvailable() || ! client.connected() )
+      return true;
+    // activeFd < 0 only before the first check, which ends the wait if
+    // the connection is refused
+    return dataPassiveConn ? dataServer.hasClient() : activeFd < 0 || fdReady( activeFd, true, 0 );
+  }
+  if( cmdStatus == C_IDLE )
+    return client.connected();
+  if( transferStatus == F_IDLE && dataCommand == D_NONE && ! ((int32_t) ( millisEndConnection - millis() ) > 0 ))
+    return true;    // timeout of the session or of its TLS handshake
+  if( ! dataReady() ){
+    // TLS handshake of the data connection
+    if( data.available() > 0 || ! data.connected() || millis() - millisBeginTrans >= FTP_TLS_TIMEOUT )
+      return true;
+  }else
+  if( transferStatus == F_RETRIEVED && rateDelay() == 0 && ( data.fd() < 0 || fdReady( data.fd(), true, 0 )))
+    return true;
+  if( transferStatus == F_STORED && ( dataAvailable() > 0 ? rateDelay() == 0 : ! data.connected() ))
+    return true;
+  return ctrlAvailable() || ! client.connected();
+}
+
+// true if bytes of a command are waiting
+
+boolean FtpServer::ctrlAvailable(){
+#if FTP_ENABLE_TLS
+  if( ctrlTls == TLS_ON ){
+    // the bytes received may be a part of a record only: take them in, they
+    // count once the record is whole and decrypted
+    if( mbedtls_ssl_get_bytes_avail( &ctrlSsl ) == 0 && client.available() > 0 ){
+      unsigned char c;
+      int r = mbedtls_ssl_read( &ctrlSsl, &c, 0 );
+      if( r < 0 && r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE ){
+        // closed by the client or broken, handleStep() sees the disconnection
+        ctrlTls = TLS_OFF;
+        client.stop();
+      }
+    }
+    return mbedtls_ssl_get_bytes_avail( &ctrlSsl ) > 0;
+  }
+#endif
+  return client.available() > 0;
+}
+
+// Time in ms until handleStep() has a timed event to handle: the end of a
+// delay, of the wait for a data connection, of a TLS handshake, of the
+// session, or tokens back for a throttled transfer. (uint32_t) -1 if none
+
+uint32_t FtpServer::timeToEvent(){
+  uint32_t now = millis();
+  if((int32_t) ( millisDelay - now ) > 0 )
+    return millisDelay - now;
+  uint32_t next = (uint32_t) -1;
+  if( cmdStatus > C_IDLE && transferStatus == F_IDLE && dataCommand == D_NONE ){
+    uint32_t end = (int32_t) ( millisEndConnection - now ) > 0 ? millisEndConnection - now : 0;
+    if( end < next )
+      next = end;
+  }
+  if( dataWait ){
+    uint32_t end = now - millisDataWait < 10000 ? 10000 - ( now - millisDataWait ) : 0;
+    if( end < next )
+      next = end;
+  }
+  if( ! dataReady() ){
+    uint32_t end = now - millisBeginTrans < FTP_TLS_TIMEOUT ? FTP_TLS_TIMEOUT - ( now - millisBeginTrans ) : 0;
+    if( end < next )
+      next = end;
+  }
+  if( transferStatus == F_RETRIEVED || transferStatus == F_STORED ){
+    uint32_t refill = rateDelay();
+    if( refill > 0 && refill < next )
+      next = refill;
+  }
+  return next;
+}
+
+// Block until the server has work to do, or timeout ms
+//
+// Sleeps in select() on the control, data and connecting sockets, so the
+// CPU can idle (and light sleep) meanwhile, and wakes up for the timed
+// events of timeToEvent(). The listening sockets of WiFiServer are not
+// reachable, so new connections are checked every FTP_WAIT_SLICE ms.
+// Built with FTP_WAIT_EPOLL (Linux host), it sleeps in epoll on the
+// listening sockets too, without these checks.
+//
+//  return:
+//    true if handleFTP() has something to do
+
+boolean FtpServer::waitFTP( uint32_t timeout ){
+  uint32_t millisBegin = millis();
+
+  for(;;){
+    if( hasWork() )
+      return true;
+    uint32_t elapsed = millis() - millisBegin;
+    if( elapsed >= timeout )
+      return false;
+    uint32_t slice = timeout - elapsed;
+#ifndef FTP_WAIT_EPOLL
+    if( slice > FTP_WAIT_SLICE )
+      slice = FTP_WAIT_SLICE;
+#endif
+    uint32_t event = timeToEvent();
+    if( event < slice )
+      slice = event > 0 ? event : 1;
+
+    // sockets to wait for, readable or writable
+    int fds[ 4 ];
+    boolean writes[ 4 ];
+    uint8_t nfds = 0;
+    if( client.connected() && client.fd() >= 0 ){
+      fds[ nfds ] = client.fd();
+      writes[ nfds++ ] = false;
+    }
+    // a throttled transfer goes on when its tokens are back
+    uint32_t refill = transferStatus == F_RETRIEVED || transferStatus == F_STORED ? rateDelay() : 0;
+    if((( transferStatus == F_STORED && refill == 0 ) || ! dataReady() ) && data.fd() >= 0 ){
+      fds[ nfds ] = data.fd();
+      writes[ nfds++ ] = false;
+    }
+    if( activeFd >= 0 ){
+      fds[ nfds ] = activeFd;
+      writes[ nfds++ ] = true;
+    }
+    if( transferStatus == F_RETRIEVED && dataCommand == D_NONE && refill == 0 && dataReady() && data.fd() >= 0 ){
+      fds[ nfds ] = data.fd();
+      writes[ nfds++ ] = true;
+    }
+
+#ifdef FTP_WAIT_EPOLL
+    if( epollFd < 0 )
+      epollFd = epoll_create1( EPOLL_CLOEXEC );
+    struct epoll_event ev;
+    if( ctrlServer.fd() != epollListen ){
+      // the listening socket stays in the set
+      if( epollListen >= 0 )
+        epoll_ctl( epollFd, EPOLL_CTL_DEL, epollListen, NULL );
+      ev.events = EPOLLIN;
+      ev.data.fd = ctrlServer.fd();
+      epoll_ctl( epollFd, EPOLL_CTL_ADD, ctrlServer.fd(), &ev );
+      epollListen = ctrlServer.fd();
+    }
+    // the others change from a call to the next (and a closed socket leaves
+    // the set by itself): add them for this wait only
+    if( dataWait && dataPassiveConn && dataServer.fd() >= 0 ){
+      fds[ nfds ] = dataServer.fd();
+      writes[ nfds++ ] = false;
+    }
+    for( uint8_t i = 0; i < nfds; i++ ){
+      ev.events = writes[ i ] ? EPOLLOUT : EPOLLIN;
+      ev.data.fd = fds[ i ];
+      if( epoll_ctl( epollFd, EPOLL_CTL_ADD, fds[ i ], &ev ) < 0 && errno == EEXIST ){
+        // the same socket read and written
+        ev.events = EPOLLIN | EPOLLOUT;
+        epoll_ctl( epollFd, EPOLL_CTL_MOD, fds[ i ], &ev );
+      }
+    }
+    struct epoll_event events[ 6 ];
+    epoll_wait( epollFd, events, 6, slice );
+    for( uint8_t i = 0; i < nfds; i++ )
+      epoll_ctl( epollFd, EPOLL_CTL_DEL, fds[ i ], NULL );
+#else
+    fd_set rfds, wfds;
+    FD_ZERO( &rfds );
+    FD_ZERO( &wfds );
+    int maxfd = -1;
+    for( uint8_t i = 0; i < nfds; i++ ){
+      FD_SET( fds[ i ], writes[ i ] ? &wfds : &rfds );
+      if( fds[ i ] > maxfd )
+        maxfd = fds[ i ];
+    }
+
+    if( maxfd < 0 ){
+      delay( slice );
+    }else{
+      struct timeval tv;
+      tv.tv_sec = slice / 1000;
+      tv.tv_usec = ( slice % 1000 ) * 1000;
+      select( maxfd + 1, &rfds, &wfds, NULL, &tv );
+    }
+#endif
+  }
+}
+
+// true if fd is readable (or writable) within timeout ms
+
+boolean FtpServer::fdReady( int fd, boolean write, uint32_t timeout ){
+  fd_set fdset;
+  FD_ZERO( &fdset );
+  FD_SET( fd, &fdset );
+  struct timeval tv;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = ( timeout % 1000 ) * 1000;
+  return select( fd + 1, write ? NULL : &fdset, write ? &fdset : NULL, NULL, &tv ) > 0;
+}
+
+// One step of the server: at most one char of command, one command or one
+// buffer of data transfer
+
+FTP_F_STATUS FtpServer::handleStep(){
   FTP_F_STATUS lastTransferStatus = F_IDLE;
 
   if((int32_t) ( millisDelay - millis() ) > 0 )
     return lastTransferStatus;
 
-  if (ftpServer.hasClient()) {
+  if (ctrlServer.hasClient()) {
+#ifdef FTP_STATS
+    if( client.connected() )
+      stats.replaced++;
+#endif
+    if( cmdStatus != C_IDLE ){
+      // the new client starts its own session, without the login and the
+      // TLS state of the one it replaces
+      abortTransfer();
+      iniVariables();
+      cmdStatus = C_IDLE;
+    }
 	  client.stop();
-	  client = ftpServer.available();
+	  client = ctrlServer.available();
   }
   
-  if( cmdStatus == 0 ){
+  if( cmdStatus == C_DISCONNECT ){
     if( client.connected())
       disconnectClient();
-    cmdStatus = 1;
+    cmdStatus = C_INIT;
   }else
-  if( cmdStatus == 1 ){
+  if( cmdStatus == C_INIT ){
     // Ftp server waiting for connection
     abortTransfer();
     iniVariables();
 #ifdef FTP_DEBUG
-     Serial.println("Ftp server waiting for connection on port "+ String(FTP_CTRL_PORT));
+     Serial.printf("Ftp server waiting for connection on port %u\n", ctrlPort);
 #endif
-    cmdStatus = 2;
+    cmdStatus = C_IDLE;
   }else
-  if( cmdStatus == 2 ){
+  if( cmdStatus == C_IDLE ){
     // Ftp server idle
     if( client.connected() ){
       // A client connected
       clientConnected();      
       millisEndConnection = millis() + 10 * 1000 ; // wait client id during 10 s.
-      cmdStatus = 3;
+      cmdStatus = C_USER;
+    }
+  }else
+#if FTP_ENABLE_TLS
+  if( ctrlTls == TLS_HANDSHAKE ){
+    // TLS handshake after AUTH, the commands that follow are encrypted
+    int8_t r = tlsHandshake( &ctrlSsl );
+    if( r > 0 ){
+      ctrlTls = TLS_ON;
+      iCL = 0;
+      millisEndConnection = millis() + ( cmdStatus == C_COMMAND ? millisTimeOut : 10 * 1000 );
+    }else
+    if( r < 0 || ! client.connected() || (int32_t) ( millisEndConnection - millis() ) <= 0 ){
+#ifdef FTP_DEBUG
+      Serial.println("TLS handshake failed");
+#endif
+      ctrlTls = TLS_OFF;
+      client.stop();
+      cmdStatus = C_INIT;
+#ifdef FTP_TRACE
+      trace(T_CTRL_CLOSE, NULL, 0);
+#endif
     }
   }else
+#endif
+  if( dataWait && ( ctrlAvailable() || ! client.connected() )){
+    // the client sent another command (ABOR, QUIT...) or left: give up
+    // the wait and the data command, the new one is read on the next steps
+    dataWait = false;
+    client_println( "425 No data connection");
+    cancelData();
+#ifdef FTP_STATS
+    stats.dataConnects++;
+    stats.dataConnectMillis += millis() - millisDataWait;
+    stats.dataRefused++;
+#endif
+  }else
+  if( dataWait ){
+    // data command waiting for its connection
+    beginData();
+  }else
   if( readChar() > 0 ){
     // got response
-    if( cmdStatus == 3 ){
+#ifdef FTP_STATS
+    uint32_t microsCmd = micros();
+#endif
+    if( cmdStatus == C_USER ){
       // Ftp server waiting for user identity
+      if( securityCommand() ){
+        // before USER, as clients asking for TLS do
+      }else
+#if FTP_ENABLE_TLS
+      if( tlsRequired && ctrlTls != TLS_ON ){
+        client_println( "530 Use AUTH TLS first");
+        millisDelay = millis() + 100;  // delay of 100 ms
+      }else
+#endif
       if( userIdentity() )
-        cmdStatus = 4;
+        cmdStatus = C_PASS;
       else
-        cmdStatus = 0;
+        cmdStatus = C_DISCONNECT;
     }else
-    if( cmdStatus == 4 ){
+    if( cmdStatus == C_PASS ){
       // Ftp server waiting for user registration
       if( userPassword() ){
-        cmdStatus = 5;
+        cmdStatus = C_COMMAND;
         millisEndConnection = millis() + millisTimeOut;
       }else{
-        cmdStatus = 0;
+        cmdStatus = C_DISCONNECT;
       }
     }else
-    if( cmdStatus == 5 ){
+    if( cmdStatus == C_COMMAND ){
       // Ftp server waiting for user command
       if( ! processCommand())
-        cmdStatus = 0;
+        cmdStatus = C_DISCONNECT;
       else
         millisEndConnection = millis() + millisTimeOut;
     }
+#ifdef FTP_STATS
+    stats.commands++;
+    histAdd( stats.cmdHist, micros() - microsCmd );
+#endif
   }else
   if (!client.connected() || !client){
-	  cmdStatus = 1;
+	  cmdStatus = C_INIT;
 #ifdef FTP_DEBUG
     Serial.println("client disconnected");
+#endif
+#ifdef FTP_TRACE
+    trace(T_CTRL_CLOSE, NULL, 0);
 #endif
   }
 
+  if( dataCommand != D_NONE ){
+    // the transfer begins with its data connection, a listing may wait
+    // for the TLS handshake of it
+#if FTP_ENABLE_LIST || FTP_ENABLE_MLSD
+    if( ! dataWait )
+      doList();
+#endif
+  }else
   if( transferStatus == F_RETRIEVED ){
     // Retrieve data
     if( ! doRetrieve() ){
@@ -172,10 +865,10 @@ FTP_F_STATUS FtpServer::handleFTP(){
     lastTransferStatus = transferStatus;
     transferStatus = F_IDLE;
   }else
-  if( cmdStatus > 2 && ! ((int32_t) ( millisEndConnection - millis() ) > 0 )){
+  if( cmdStatus > C_IDLE && ! ((int32_t) ( millisEndConnection - millis() ) > 0 )){
     client_println("530 Timeout");
     millisDelay = millis() + 200;    // delay of 200 ms
-    cmdStatus = 0;
+    cmdStatus = C_DISCONNECT;
   }
 
   return lastTransferStatus;
@@ -184,10 +877,16 @@ FTP_F_STATUS FtpServer::handleFTP(){
 void FtpServer::clientConnected(){
 #ifdef FTP_DEBUG
 	Serial.println("Client connected!");
+#endif
+#ifdef FTP_STATS
+  stats.connections++;
+#endif
+#ifdef FTP_TRACE
+  trace(T_CTRL_OPEN, NULL, 0);
 #endif
   client_println( "220--- Welcome to FTP for ESP8266 ---");
   client_println( "220---   By David Paiva   ---");
-  client_println( "220 --   Version "+ String(FTP_SERVER_VERSION) +"   --");
+  client_println( "220 --   Version " FTP_SERVER_VERSION "   --");
   iCL = 0;
 }
 
@@ -197,14 +896,22 @@ void FtpServer::disconnectClient(){
 #endif
   abortTransfer();
   client_println("221 Goodbye");
+#if FTP_ENABLE_TLS
+  if( ctrlTls == TLS_ON )
+    tlsClose( &ctrlSsl );
+  ctrlTls = TLS_OFF;
+#endif
   client.stop();
+#ifdef FTP_TRACE
+  trace(T_CTRL_CLOSE, NULL, 0);
+#endif
 }
 
 boolean FtpServer::userIdentity(){	
   if( strcmp( command, "USER" )){
     client_println( "500 Syntax error");
   }else
-  if( strcmp( parameters, _FTP_USER.c_str() )){
+  if( strcmp( parameters, _FTP_USER )){
     client_println( "530 user not found");
   }else{
     client_println( "331 OK. Password required");
@@ -216,11 +923,79 @@ boolean FtpServer::userIdentity(){
   return false;
 }
 
+// Security extensions (RFC 2228, RFC 4217)
+//
+// AUTH TLS starts the handshake of the control connection once the 234
+// reply is sent; handleStep() goes on with it. Without a certificate (or
+// with FTP_ENABLE_TLS set to 0) AUTH is refused and only the clear
+// protection level is accepted, so that clients set to "use TLS if
+// available" go on with USER.
+//
+//  return:
+//    true if command was one of AUTH, PBSZ, PROT
+
+boolean FtpServer::securityCommand(){
+  if( ! strcmp( command, "AUTH" )){
+#if FTP_ENABLE_TLS
+    if( ! tlsReady ){
+      client_println( "504 AUTH not supported");
+    }else
+    if( ctrlTls == TLS_ON ){
+      client_println( "503 TLS already active");
+    }else
+    if( strcasecmp( parameters, "TLS" ) && strcasecmp( parameters, "TLS-C" ) && strcasecmp( parameters, "SSL" )){
+      client_println( "504 Only AUTH TLS is supported");
+    }else{
+      client_println( "234 AUTH TLS OK");
+      mbedtls_ssl_session_reset( &ctrlSsl );
+      ctrlFd = client.fd();
+      ctrlTls = TLS_HANDSHAKE;
+      millisEndConnection = millis() + FTP_TLS_TIMEOUT;
+    }
+#else
+    client_println( "504 AUTH not supported");
+#endif
+  }else
+  if( ! strcmp( command, "PBSZ" )){
+    // TLS records are delimited, there is no buffer size to agree on
+#if FTP_ENABLE_TLS
+    if( ctrlTls == TLS_ON )
+      client_println( "200 PBSZ=0");
+    else
+#endif
+      client_println( "503 Security data exchange not completed");
+  }else
+  if( ! strcmp( command, "PROT" )){
+    if( ! strcmp( parameters, "C" )){
+#if FTP_ENABLE_TLS
+      dataProt = false;
+#endif
+      client_println( "200 Protection level set to Clear");
+    }else
+#if FTP_ENABLE_TLS
+    if( ! strcmp( parameters, "P" )){
+      if( ctrlTls == TLS_ON ){
+        dataProt = true;
+        client_println( "200 Protection level set to Private");
+      }else{
+        client_println( "503 PROT P needs AUTH TLS first");
+      }
+    }else
+      client_println( "536 Only C(lear) and P(rivate) are supported");
+#else
+      client_println( "536 Only C(lear) is supported");
+#endif
+  }else{
+    return false;
+  }
+  return true;
+}
+
 boolean FtpServer::userPassword(){
   if( strcmp( command, "PASS" )){
     client_println( "500 Syntax error");
   }else
-  if(  _FTP_PASS != "" && strcmp( parameters, _FTP_PASS.c_str() )){
+  if(  _FTP_PASS[0] != '\0' && strcmp( parameters, _FTP_PASS )){
     client_println( "530 ");
   }else{
 #ifdef FTP_DEBUG
@@ -235,6 +1010,10 @@ boolean FtpServer::userPassword(){
 }
 
 boolean FtpServer::processCommand(){
+  // REST only applies to the command following it
+  unsigned long restart = restartOffset;
+  restartOffset = 0;
+
   ///////////////////////////////////////
   //                                   //
   //      ACCESS CONTROL COMMANDS      //
@@ -245,7 +1024,7 @@ boolean FtpServer::processCommand(){
   //  CDUP - Change to Parent Directory 
   //
   if( ! strcmp( command, "CDUP" )){
-	  client_println("250 Ok. Current directory is " + String(cwdName));
+	  client_printf("250 Ok. Current directory is %s", cwdName);
   }else
   //
   //  CWD - Change Working Directory
@@ -253,16 +1032,16 @@ boolean FtpServer::processCommand(){
   if( ! strcmp( command, "CWD" )){
     if( strcmp( parameters, "." ) == 0 ){
       // 'CWD .' is the same as PWD command
-      client_println( "257 \"" + String(cwdName) + "\" is your current directory");
+      client_printf( "257 \"%s\" is your current directory", cwdName);
     }else{
-      client_println( "250 Ok. Current directory is " + String(cwdName) );
+      client_printf( "250 Ok. Current directory is %s", cwdName );
     }
   }else
   //
   //  PWD - Print Directory
   //
   if( ! strcmp( command, "PWD" )){
-    client_println( "257 \"" + String(cwdName) + "\" is your current directory");
+    client_printf( "257 \"%s\" is your current directory", cwdName);
   }else
   //
   //  QUIT
@@ -271,6 +1050,11 @@ boolean FtpServer::processCommand(){
     disconnectClient();
     return false;
   }else
+  //
+  //  AUTH, PBSZ, PROT - Security extensions
+  //
+  if( securityCommand() ){
+  }else
 
   ///////////////////////////////////////
   //                                   //
@@ -293,14 +1077,18 @@ boolean FtpServer::processCommand(){
   if( ! strcmp( command, "PASV" )){
     if (data.connected())
       data.stop();
+    closeActive();
+    // drop connections left by commands that failed before dataConnect()
+    while( dataServer.hasClient() )
+      dataServer.available().stop();
 
     dataIp = WiFi.localIP();	
-    dataPort = FTP_DATA_PORT_PASV;
+    dataPort = pasvPort;
 #ifdef FTP_DEBUG
 	  Serial.println("Connection management set to passive");
-    Serial.println( "Data port set to " + String(dataPort));
+    Serial.printf( "Data port set to %u\n", dataPort);
 #endif
-    client_println( "227 Entering Passive Mode (" + String(dataIp[0]) + "," + String(dataIp[1]) + "," + String(dataIp[2]) + "," +  String(dataIp[3]) + "," + String( dataPort >> 8 ) + "," + String ( dataPort & 255 ) + ").");
+    client_printf( "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u).", dataIp[0], dataIp[1], dataIp[2], dataIp[3], dataPort >> 8, dataPort & 255 );
     dataPassiveConn = true;
   }else
   //
@@ -309,23 +1097,33 @@ boolean FtpServer::processCommand(){
   if( ! strcmp( command, "PORT" )){
 	  if (data.connected())
       data.stop();
+    closeActive();
 
-    // get IP of data client
-    dataIp[0] = atoi( parameters );
-    char *p = strchr( parameters, ',' );
-    for( uint8_t i = 1; i < 4; i ++ ){
-      dataIp[i] = atoi( ++ p );
-      p = strchr( p, ',' );
-    }
-    // get port of data client
-    dataPort = 256 * atoi( ++ p );
-    p = strchr( p, ',' );
-    dataPort += atoi( ++ p );
-    if( p == NULL ){
+    // get IP and port of data client
+    unsigned int h[ 6 ];
+    boolean valid = sscanf( parameters, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5] ) == 6;
+    for( uint8_t i = 0; valid && i < 6; i ++ )
+      valid = h[i] <= 255;
+    IPAddress ip;
+    if( valid )
+      ip = IPAddress( h[0], h[1], h[2], h[3] );
+    if( ! valid ){
       client_println( "501 Can't interpret parameters");
+    }else
+    if( (uint32_t) ip != (uint32_t) client.remoteIP() ){
+      // no data connection to a third host, the FTP bounce attack (RFC 2577)
+      client_println( "504 Data connection only to the client's address");
+    }else
+    if( 256 * h[4] + h[5] < 1024 ){
+      client_println( "504 Data port below 1024 refused");
     }else{
-      client_println("200 PORT command successful");
+      dataIp = ip;
+      dataPort = 256 * h[4] + h[5];
       dataPassiveConn = false;
+      // connect now, the connection is usually ready when RETR/STOR/LIST come
+      startActive();
+      activeAgain = false;
+      client_println("200 PORT command successful");
     }
   }else
   //
@@ -362,6 +1160,7 @@ boolean FtpServer::processCommand(){
     abortTransfer();
     client_println( "226 Data connection closed");
   }else
+#if FTP_ENABLE_DELETE
   //
   //  DELE - Delete a File 
   //
@@ -371,82 +1170,50 @@ boolean FtpServer::processCommand(){
       client_println( "501 No file name");
     }else
     if( makePath( path )){
+      if( isReadOnly( path )){
+        client_printf( "550 File %s is read-only", parameters);
+      }else
+      if( isBusy() ){
+        client_printf( "450 File %s is busy", parameters);
+      }else
       if( file_name[0] == '\0' || strcmp( path, file_name ) != 0 ){
-        client_println( "550 File " + String(parameters) + " not found");
+        client_printf( "550 File %s not found", parameters);
       }else{
         file_name[0] = '\0';
         file_buffer_size = 0;
-        client_println( "250 Deleted " + String(parameters) );
+        client_printf( "250 Deleted %s", parameters );
         transferStatus = F_DELETED;
       }
     }
   }else
+#endif
+#if FTP_ENABLE_LIST
   //
   //  LIST - List 
   //
   if( ! strcmp( command, "LIST" )){
-    if( ! dataConnect()){
-      client_println( "425 No data connection");
-    }else{
-      client_println( "150 Accepted data connection");
-
-      uint16_t nm = 0;
-      if( file_name[0] != '\0' ){
-        String fn(file_name);
-        if( file_name[0] == '/')
-    			fn.remove(0, 1);
-        String dt = toDateTimeStr(0);
-        data_println( dt + " " + String(file_buffer_size) + " " + fn);
-        nm++;
-      }
-      client_println( "226 " + String(nm) + " matches total");
-      data.stop();
-    }
+    dataCommand = D_LIST;
+    beginData();
   }else
+#endif
+#if FTP_ENABLE_MLSD
   //
   //  MLSD - Listing for Machine Processing (see RFC 3659)
   //
   if( ! strcmp( command, "MLSD" )){
-    if( ! dataConnect()){
-      client_println( "425 No data connection MLSD");
-    }else{
-  	  client_println( "150 Accepted data connection");
-
-      uint16_t nm = 0;
-      if( file_name[0] != '\0' ){
-        String fn(file_name);
-        if( file_name[0] == '/' )
-    			fn.remove(0, 1);
-        String dt = toDateTimeStr(1);
-        data_println( "Type=file;Size=" + String(file_buffer_size) + ";modify=" + dt + "; " + fn);
-        nm++;
-      }
-      client_println( "226-options: -a -l");
-      client_println( "226 " + String(nm) + " matches total");
-      data.stop();
-    }
+    dataCommand = D_MLSD;
+    beginData();
   }else
+#endif
+#if FTP_ENABLE_LIST
   //
   //  NLST - Name List 
   //
   if( ! strcmp( command, "NLST" )){
-    if( ! dataConnect()){
-      client_println( "425 No data connection");
-    }else{
-      client_println( "150 Accepted data connection");
-
-      uint16_t nm = 0;
-      if( file_name[0] != '\0' ){
-        String fn(file_name);
-        if( file_name[0] == '/' )
-    			fn.remove(0, 1);
-        data_println(fn);
-        nm++;
-      }
-      client_println( "226 " + String(nm) + " matches total");
-      data.stop();
-    }
+    dataCommand = D_NLST;
+    beginData();
   }else
+#endif
   //
   //  NOOP
   //
@@ -454,6 +1221,19 @@ boolean FtpServer::processCommand(){
     client_println( "200 Zzz...");
   }else
   //
+  //  REST - Restart
+  //
+  if( ! strcmp( command, "REST" )){
+    char *end;
+    restartOffset = strtoul( parameters, &end, 10 );
+    if( strlen( parameters ) == 0 || *end != '\0' ){
+      restartOffset = 0;
+      client_println( "501 Can't interpret parameters");
+    }else{
+      client_printf( "350 Restarting at %lu", restartOffset);
+    }
+  }else
+  //
   //  RETR - Retrieve
   //
   if( ! strcmp( command, "RETR" )){
@@ -462,20 +1242,44 @@ boolean FtpServer::processCommand(){
       client_println( "501 No file name");
     }else
     if( makePath( path )){
-      if( file_name[0] == '\0' || strcmp( path, file_name ) != 0 ){
-        client_println( "550 File " + String(parameters) + " not found");
+      FTP_FILE file;
+#if FTP_ENABLE_TAR
+      char dir[ FTP_CWD_SIZE ];
+#endif
+      if( ! findFile( path, &file )
+#if FTP_ENABLE_TAR
+        && ! findTar( path, &file, dir )
+#endif
+        ){
+        client_printf( "550 File %s not found", parameters);
       }else
-      if( ! dataConnect()){
-        client_println( "425 No data connection");
+      if( restart > file.size ){
+        client_println( "554 Invalid REST parameter");
       }else{
 #ifdef FTP_DEBUG
-  		  Serial.println("Sending " + String(parameters));
+  		  Serial.printf("Sending %s\n", parameters);
 #endif
-        client_println( "150-Connected to port "+ String(dataPort));
-        client_println( "150 " + String(file_buffer_size) + " bytes to download");
-        millisBeginTrans = millis();
-        bytesTransfered = 0;
+        // the file is read in place, STOR/DELE/RNFR wait for the end of the
+        // transfer, from now on as it begins with the data connection
+#if FTP_ENABLE_TAR
+        if( file.archive ){
+          // the archive is made of the files there now, as announced by its
+          // size, whatever files are added meanwhile
+          strcpy( tarDir, dir );
+          file.name = tarDir;
+          tarCount = 0;
+          FTP_FILE member;
+          for( uint8_t i = 0; getFile( i, &member ) && tarCount < FTP_MAX_ROFILES + 2; i++ )
+            if( tarMember( tarDir, member.name ) != NULL )
+              tarFiles[ tarCount++ ] = member;
+        }
+#endif
+        retrFile = file;
+        retrOffset = restart;
+        retrSize = file.size - restart;
         transferStatus = F_RETRIEVED;
+        dataCommand = D_RETR;
+        beginData();
       }
     }
   }else
@@ -488,18 +1292,28 @@ boolean FtpServer::processCommand(){
       client_println( "501 No file name");
     }else
     if( makePath( path )){
-      if( ! dataConnect()){
-        client_println( "425 No data connection");
+      if( isReadOnly( path )){
+        client_printf( "550 File %s is read-only", parameters);
+      }else
+      if( isBusy() ){
+        client_printf( "450 File %s is busy", parameters);
+      }else
+      if( strlen( path ) >= FNAME_LENGTH ){
+        client_println( "553 File name too long");
+      }else
+      if( ! storRestart( path, restart )){
+        client_println( "554 Invalid REST parameter");
+      }else
+      if( ! prepareWrite( file_compressed && restart > 0 ? file_stored_size : restart )){
+        client_printf( "450 File %s is held by a snapshot", parameters);
       }else{
 #ifdef FTP_DEBUG
-        Serial.println( "Receiving " + String(parameters));
+        Serial.printf( "Receiving %s\n", parameters);
 #endif
-        strcpy(file_name, path);
-        file_buffer_size = 0;
-        client_println( "150 Connected to port " + String(dataPort));
-        millisBeginTrans = millis();
-        bytesTransfered = 0;
-        transferStatus = F_STORED;
+        strcpy( storPath, path );
+        storOffset = restart;
+        dataCommand = D_STOR;
+        beginData();
       }
     }
   }else
@@ -507,28 +1321,39 @@ boolean FtpServer::processCommand(){
   //  MKD - Make Directory
   //
   if( ! strcmp( command, "MKD" )){
-	  client_println( "550 Can't create \"" + String(parameters));  //not support on espyet
+	  client_printf( "550 Can't create \"%s", parameters);  //not support on espyet
   }else
   //
   //  RMD - Remove a Directory 
   //
   if( ! strcmp( command, "RMD" )){
-	  client_println( "501 Can't delete \"" +String(parameters));
+	  client_printf( "501 Can't delete \"%s", parameters);
   }else
+#if FTP_ENABLE_RENAME
   //
   //  RNFR - Rename From 
   //
   if( ! strcmp( command, "RNFR" )){
-    buf[ 0 ] = 0;
+    if( transferStatus == F_STORED ){
+      // buf holds data of the file being stored
+      client_println( "450 Transfer in progress");
+    }else
     if( strlen( parameters ) == 0 ){
+      buf[ 0 ] = 0;
       client_println( "501 No file name");
     }else
     if( makePath( buf )){
+      if( isReadOnly( buf )){
+        client_printf( "550 File %s is read-only", parameters);
+      }else
+      if( isBusy() ){
+        client_printf( "450 File %s is busy", parameters);
+      }else
       if( file_name[0] == '\0' || strcmp(buf, file_name) != 0){
-        client_println( "550 File " + String(parameters) + " not found");
+        client_printf( "550 File %s not found", parameters);
       }else{
 #ifdef FTP_DEBUG
-  		  Serial.println("Renaming " + String(buf));
+  		  Serial.printf("Renaming %s\n", buf);
 #endif
         client_println( "350 RNFR accepted - file exists, ready for destination");     
         rnfrCmd = true;
@@ -545,11 +1370,15 @@ boolean FtpServer::processCommand(){
     else if( strlen( parameters ) == 0 )
       client_println( "501 No file name");
     else if( makePath( path )){
-      if( file_name[0] != '\0' && strcmp( path, file_name ) == 0){
-        client_println( "553 " + String(parameters) + " already exists");
+      FTP_FILE file;
+      if( findFile( path, &file )){
+        client_printf( "553 %s already exists", parameters);
+      }else
+      if( strlen( path ) >= FNAME_LENGTH ){
+        client_println( "553 File name too long");
       }else{
 #ifdef FTP_DEBUG
-  		  Serial.println("Renaming " + String(buf) + " to " + String(path));
+  		  Serial.printf("Renaming %s to %s\n", buf, path);
 #endif
         strcpy( file_name, path );
         client_println( "250 File successfully renamed or moved");
@@ -558,6 +1387,7 @@ boolean FtpServer::processCommand(){
     }
     rnfrCmd = false;
   }else
+#endif
 
   ///////////////////////////////////////
   //                                   //
@@ -570,7 +1400,18 @@ boolean FtpServer::processCommand(){
   //
   if( ! strcmp( command, "FEAT" )){
     client_println( "211-Extensions suported:");
+#if FTP_ENABLE_MLSD
     client_println( " MLSD");
+#endif
+    client_println( " REST STREAM");
+    client_println( " SIZE");
+#if FTP_ENABLE_TLS
+    if( tlsReady ){
+      client_println( " AUTH TLS");
+      client_println( " PBSZ");
+      client_println( " PROT");
+    }
+#endif
     client_println( "211 End.");
   }else
   //
@@ -582,11 +1423,12 @@ boolean FtpServer::processCommand(){
       client_println( "501 No file name");
     }else
     if( makePath( path )){
-      if( file_name[0] == '\0' || strcmp( path, file_name ) != 0 ){
-          client_println( "450 Can't open " +String(parameters) );
+      FTP_FILE file;
+      if( ! findFile( path, &file )){
+          client_printf( "450 Can't open %s", parameters );
       }else{
-        String tm = toDateTimeStr(1);
-        client_println("213 " + tm);
+        char tm[ 20 ];
+        client_printf("213 %s", toDateTimeStr(tm, file.timeInfo, 1));
       }
     }
   }else
@@ -599,10 +1441,18 @@ boolean FtpServer::processCommand(){
       client_println( "501 No file name");
     }else
     if( makePath( path )){
-      if( file_name[0] == '\0' || strcmp( path, file_name ) != 0 ){
-         client_println( "450 Can't open " +String(parameters) );
+      FTP_FILE file;
+#if FTP_ENABLE_TAR
+      char dir[ FTP_CWD_SIZE ];
+#endif
+      if( ! findFile( path, &file )
+#if FTP_ENABLE_TAR
+        && ! findTar( path, &file, dir )
+#endif
+        ){
+         client_printf( "450 Can't open %s", parameters );
       }else{
-        client_println( "213 " + String(file_buffer_size));
+        client_printf( "213 %lu", file.size);
       }
     }
   }else
@@ -610,14 +1460,49 @@ boolean FtpServer::processCommand(){
   //  SITE - System command
   //
   if( ! strcmp( command, "SITE" )){
-    client_println( "500 Unknow SITE command " +String(parameters) );
+    if( ! strncasecmp( parameters, "RATE", 4 ) && ( parameters[4] == ' ' || parameters[4] == '\0' )){
+      char *p = parameters + 4;
+      while( *p == ' ' )
+        p++;
+      char *end;
+      unsigned long rate = strtoul( p, &end, 10 );
+      if( *end != '\0' ){
+        client_println( "501 Can't interpret parameters");
+      }else{
+        // 0 drops the limit of the client, not the one of the application
+        if( *p != '\0' )
+          rateClient = rate;
+        client_printf( "200 Rate limit %lu bytes/s (global %lu bytes/s)", rateLimit(), rateGlobal);
+      }
+    }else
+#if FTP_ENABLE_SNAPSHOT
+    if( ! strncasecmp( parameters, "SNAP", 4 ) && ( parameters[4] == ' ' || parameters[4] == '\0' )){
+      char *p = parameters + 4;
+      while( *p == ' ' )
+        p++;
+      if( ! strcasecmp( p, "RELEASE" )){
+        if( releaseSnapshot() )
+          client_println( "200 Snapshot released");
+        else
+          client_println( "550 No snapshot");
+      }else
+      if( snapshot( p )){
+        client_printf( "200 Snapshot %s", snap.path);
+      }else{
+        client_println( "550 Can't create snapshot");
+      }
+    }else
+#endif
+    {
+      client_printf( "500 Unknow SITE command %s", parameters );
+    }
   }else
   //
   //  Unrecognized commands ...
   //
   {
 #ifdef FTP_DEBUG
-    Serial.println("Unknow command: " + String(command));
+    Serial.printf("Unknow command: %s\n", command);
 #endif
     client_println( "500 Unknow command");
   }
@@ -625,46 +1510,305 @@ boolean FtpServer::processCommand(){
   return true;
 }
 
-String FtpServer::toDateTimeStr(int type){
+// Format the time of the file into datetime_str (20 bytes at least)
+//   type 0: LIST format, 1: MLSD/MDTM format
+// Fields are brought in range so that the result always fits
+
+char *FtpServer::toDateTimeStr(char *datetime_str, const struct tm *timeInfo, int type){
+  unsigned int year = (unsigned int)( timeInfo->tm_year + 1900 ) % 10000;
+  unsigned int mon = (unsigned int)( timeInfo->tm_mon + 1 ) % 100;
+  unsigned int mday = (unsigned int) timeInfo->tm_mday % 100;
+  unsigned int hour = (unsigned int) timeInfo->tm_hour % 100;
+  unsigned int min = (unsigned int) timeInfo->tm_min % 100;
+  unsigned int sec = (unsigned int) timeInfo->tm_sec % 100;
+
   if( type == 0 ){
-    char datetime_str[19];
-    sprintf(datetime_str, "%02d-%02d-%04d %02d:%02d%s", file_timeInfo.tm_mon + 1, file_timeInfo.tm_mday, file_timeInfo.tm_year + 1900, file_timeInfo.tm_hour % 12, file_timeInfo.tm_min, file_timeInfo.tm_hour >= 12 ? "PM" : "AM" );
-    return String(datetime_str);
+    snprintf(datetime_str, 20, "%02u-%02u-%04u %02u:%02u%s", mon, mday, year, hour % 12, min, hour >= 12 ? "PM" : "AM" );
   }else if( type == 1){
-    char datetime_str[15];
-    sprintf(datetime_str, "%04d%02d%02d%02d%02d%02d", file_timeInfo.tm_year + 1900, file_timeInfo.tm_mon + 1, file_timeInfo.tm_mday, file_timeInfo.tm_hour, file_timeInfo.tm_min, file_timeInfo.tm_sec);
-    return String(datetime_str);
+    snprintf(datetime_str, 20, "%04u%02u%02u%02u%02u%02u", year, mon, mday, hour, min, sec);
   }else{
-    return String("");
+    datetime_str[0] = '\0';
   }
+  return datetime_str;
 }
 
+// Start a non blocking connection to dataIp:dataPort for active mode
+
+void FtpServer::startActive(){
+  closeActive();
+
+  activeFd = socket( AF_INET, SOCK_STREAM, 0 );
+  if( activeFd < 0 )
+    return;
+  fcntl( activeFd, F_SETFL, fcntl( activeFd, F_GETFL, 0 ) | O_NONBLOCK );
+
+  struct sockaddr_in addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = (uint32_t) dataIp;
+  addr.sin_port = htons( dataPort );
+  if( connect( activeFd, (struct sockaddr*) &addr, sizeof(addr) ) < 0 && errno != EINPROGRESS ){
+#ifdef FTP_DEBUG
+    Serial.printf("active connect failed: %d\n", errno);
+#endif
+    closeActive();
+  }
+}
+
+void FtpServer::closeActive(){
+  if( activeFd >= 0 ){
+    close( activeFd );
+    activeFd = -1;
+  }
+}
+
+// Wait up to timeout ms for the active connection started by startActive()
+//
+//  return:
+//    true if connected, data then holds the connection
+
+boolean FtpServer::waitActive( uint32_t timeout ){
+  if( activeFd < 0 )
+    return false;
+
+  if( ! fdReady( activeFd, true, timeout ))
+    return false;   // still connecting
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if( getsockopt( activeFd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 || err != 0 ){
+#ifdef FTP_DEBUG
+    Serial.printf("active connect failed: %d\n", err);
+#endif
+    closeActive();
+    return false;
+  }
+
+  // WiFiClient expects a blocking socket
+  fcntl( activeFd, F_SETFL, fcntl( activeFd, F_GETFL, 0 ) & ~O_NONBLOCK );
+  data.stop();
+  data = WiFiClient( activeFd );
+  activeFd = -1;
+#ifdef FTP_TRACE
+  trace(T_DATA_OPEN, NULL, 0);
+#endif
+  return true;
+}
+
+// Check for the data connection, without blocking
+//
+//  return:
+//    true if connected
+//    false with dataWait set if still waiting: handleStep() calls
+//      beginData() again on its next calls, during 10 s at most
+//    false with dataWait cleared if there is no data connection
+
 boolean FtpServer::dataConnect(){
-  unsigned long startTime = millis();
-  //wait 5 seconds for a data connection
-  if (!data.connected()){
-    while (!dataServer.hasClient() && millis() - startTime < 10000){
-		  yield();
-	  }
+  if( ! dataWait ){
+    dataWait = true;
+    millisDataWait = millis();
+  }
 
+  boolean refused = false;
+  if( ! dataPassiveConn ){
+    // active mode, connection started by PORT, or again once for the next
+    // transfer. Refused, the client gets 425 at once: no new attempt before
+    // another PORT
+    if( ! data.connected() ){
+      if( activeFd < 0 && activeAgain ){
+        activeAgain = false;
+        startActive();
+      }
+      refused = ! waitActive( 0 ) && activeFd < 0;
+    }
+  }else
+  if (!data.connected()){
     if (dataServer.hasClient()) {
 		  data.stop();
 		  data = dataServer.available();
 #ifdef FTP_DEBUG
       Serial.println("ftpdataserver client....");
+#endif
+#ifdef FTP_TRACE
+      trace(T_DATA_OPEN, NULL, 0);
 #endif
 	  }
   }
 
+  if( ! data.connected() && ! refused && millis() - millisDataWait < 10000 )
+    return false;
+
+  dataWait = false;
+#ifdef FTP_STATS
+  stats.dataConnects++;
+  stats.dataConnectMillis += millis() - millisDataWait;
+  if( ! data.connected() )
+    stats.dataRefused++;
+#endif
   return data.connected();
 }
 
+// Go on with the command waiting in dataCommand, accepted by
+// processCommand(): once its data connection is there, begin the transfer
+// or send the listing. Until then handleStep() calls it again, only
+// checking for the connection. Every way out but waiting ends the command.
+
+void FtpServer::beginData(){
+  if( ! dataConnect()){
+    if( ! dataWait ){
+      client_println( "425 No data connection");
+      cancelData();
+    }
+    return;
+  }
+
+  if( dataCommand == D_RETR ){
+    client_printf( "150-Connected to port %u", dataPort);
+    client_printf( "150 %lu bytes to download", retrSize);
+    beginTransfer();
+  }else
+  if( dataCommand == D_STOR ){
+    // the application may have changed the file meanwhile
+    if( ! storRestart( storPath, storOffset )){
+      client_println( "554 Invalid REST parameter");
+      closeData();
+    }else
+    if( ! prepareWrite( file_compressed && storOffset > 0 ? file_stored_size : storOffset )){
+      client_printf( "450 File %s is held by a snapshot", storPath);
+      closeData();
+    }else{
+      strcpy( file_name, storPath );
+      // resume an upload after REST, otherwise replace the file
+      file_buffer_size = storOffset;
+      if( storOffset == 0 ){
+        file_compressed = compression;
+        file_stored_size = 0;
+        readCursor.data = retrCursor.data = NULL;
+      }
+      bufFill = 0;
+      client_printf( "150 Connected to port %u", dataPort);
+      transferStatus = F_STORED;
+      beginTransfer();
+    }
+  }else{
+#if FTP_ENABLE_LIST || FTP_ENABLE_MLSD
+    // the listing is sent by doList(), now or after the TLS handshake
+    client_println( "150 Accepted data connection");
+    beginTransfer();
+    doList();
+#endif
+    return;
+  }
+  dataCommand = D_NONE;
+}
+
+// Drop the command waiting for its data connection, without a reply
+
+void FtpServer::cancelData(){
+  if( dataCommand == D_RETR )
+    transferStatus = F_IDLE;
+  dataCommand = D_NONE;
+}
+
+void FtpServer::beginTransfer(){
+  millisBeginTrans = millis();
+  bytesTransfered = 0;
+  rateBucket.tokens = 0;
+  rateBucket.remainder = 0;
+  rateBucket.millisRefill = millisBeginTrans;
+  rateShareBucket = rateBucket;
+  secureData();
+}
+
+#if FTP_ENABLE_LIST || FTP_ENABLE_MLSD
+// Send the listing asked by dataCommand once the data connection is ready,
+// then end the command. Until then handleStep() calls it again, each call
+// going on with the TLS handshake as far as the bytes received allow.
+
+void FtpServer::doList(){
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_HANDSHAKE ){
+    int8_t r = tlsHandshake( &dataSsl );
+    if( r == 0 && data.connected() && millis() - millisBeginTrans < FTP_TLS_TIMEOUT )
+      return;
+    if( r <= 0 ){
+      client_println( "522 Data connection TLS negotiation failed");
+      closeData();
+      dataCommand = D_NONE;
+      return;
+    }
+    dataTls = TLS_ON;
+  }
+#endif
+  uint16_t nm = 0;
+  FTP_FILE file;
+  while( getFile( nm, &file )){
+    const char *fn = file.name;
+    if( fn[0] == '/' )
+      fn++;
+    char dt[ 20 ];
+    if( dataCommand == D_MLSD )
+      data_printf( "Type=file;Size=%lu;modify=%s;%s %s", file.size, toDateTimeStr(dt, file.timeInfo, 1), file.readOnly ? "perm=r;" : "", fn);
+    else
+    if( dataCommand == D_NLST )
+      data_println(fn);
+    else
+      data_printf( "%s %lu %s", toDateTimeStr(dt, file.timeInfo, 0), file.size, fn);
+    nm++;
+  }
+  if( dataCommand == D_MLSD )
+    client_println( "226-options: -a -l");
+  client_printf( "226 %u matches total", nm);
+  closeData();
+  dataCommand = D_NONE;
+}
+#endif
+
 boolean FtpServer::doRetrieve(){
 #ifdef FTP_DEBUG
   Serial.println("doRetrieve()");
 #endif
-  data.write(file_buffer, file_buffer_size);
-  bytesTransfered += file_buffer_size;
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_HANDSHAKE )
+    return dataHandshake();
+#endif
+  if( data.connected() && bytesTransfered < retrSize ){
+    // Send at most one buffer per call so that control commands (ABOR...)
+    // are still served between chunks, and only when the socket takes it,
+    // so that a slow client doesn't block the server
+    if( ! fdReady( data.fd(), true, 0 ))
+      return true;
+    unsigned long nb = retrSize - bytesTransfered;
+    if( nb > FTP_BUF_SIZE )
+      nb = FTP_BUF_SIZE;
+    nb = takeTokens( nb );
+    if( nb > 0 ){
+      const unsigned char *p;
+      if( retrFile.compressed || retrFile.archive ){
+        nb = readFileData( &retrFile, retrOffset + bytesTransfered, (unsigned char*) buf, nb, &retrCursor );
+        if( nb == 0 ){
+          abortTransfer();
+          return false;
+        }
+        p = (unsigned char*) buf;
+      }else{
+        p = &retrFile.data[ retrOffset + bytesTransfered ];
+      }
+      dataWrite(p, nb);
+      bytesTransfered += nb;
+#ifdef FTP_STATS
+      stats.bytesSent += nb;
+#endif
+    }
+    if( bytesTransfered < retrSize )
+      return true;
+  }
+
+  if( bytesTransfered < retrSize ){
+    // the data connection was lost before the end
+    abortTransfer();
+    return false;
+  }
   closeTransfer();
 
   return false;
@@ -674,13 +1818,40 @@ boolean FtpServer::doStore(){
 #ifdef FTP_DEBUG
   Serial.println("doStore()");
 #endif
-  if( data.connected() ){
-    int16_t nb = data.readBytes((uint8_t*) buf, FTP_BUF_SIZE );
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_HANDSHAKE )
+    return dataHandshake();
+#endif
+  // only read what has arrived, so that handleFTP() never waits for data
+  int avail = dataAvailable();
+  if( avail > 0 ){
+    // compressed blocks are filled up to FTP_BUF_SIZE, whatever the size
+    // of the reads, so that small segments are not compressed one by one
+    unsigned long room = FTP_BUF_SIZE - bufFill;
+    unsigned long wanted = takeTokens( (unsigned long) avail < room ? avail : room );
+    if( wanted == 0 )
+      return true;
+    int16_t nb = dataRead((uint8_t*) &buf[ bufFill ], wanted );
     if( nb > 0 ){
-      if( file_buffer_size + nb <= file_buffer_length ){
-        memmove(&file_buffer[file_buffer_size], buf, nb);
-        file_buffer_size += nb;
+#ifdef FTP_TRACE
+      trace(T_DATA_IN, &buf[ bufFill ], nb);
+#endif
+      boolean stored;
+      if( file_compressed ){
+        bufFill += nb;
+        stored = bufFill < FTP_BUF_SIZE || storeBlock( bufFill );
+      }else{
+        stored = file_buffer_size + nb <= file_buffer_length;
+        if( stored ){
+          memmove(&file_buffer[file_buffer_size], buf, nb);
+          file_buffer_size += nb;
+        }
+      }
+      if( stored ){
         bytesTransfered += nb;
+#ifdef FTP_STATS
+        stats.bytesReceived += nb;
+#endif
         return true;
       }else{
         Serial.println("File buffer size overflow");
@@ -689,8 +1860,13 @@ boolean FtpServer::doStore(){
       }
     }
   }
+  if( data.connected() )
+    return true;
 
-  getLocalTime(&file_timeInfo);
+  // end of the file, store the last block
+  if( bufFill > 0 && ! storeBlock( bufFill ))
+    Serial.println("File buffer size overflow");
+  getLocalTime(&file_timeInfo, 0);
   closeTransfer();
 
   return false;
@@ -703,26 +1879,644 @@ void FtpServer::closeTransfer(){
   uint32_t deltaT = (int32_t) ( millis() - millisBeginTrans );
   if( deltaT > 0 && bytesTransfered > 0 ){
     client_println( "226-File successfully transferred");
-    client_println( "226 " + String(deltaT) + " ms, "+ String(bytesTransfered / deltaT) + " kbytes/s");
+    client_printf( "226 %lu ms, %lu kbytes/s", (unsigned long) deltaT, (unsigned long)( bytesTransfered / deltaT ));
   }else{
     client_println( "226 File successfully transferred");
   }
   
-  data.stop();
+  closeData();
+}
+
+// Session limit in bytes/s applying to the current transfer, 0 if unlimited
+
+unsigned long FtpServer::rateLimit(){
+  if( rateClient == 0 )
+    return rateSession;
+  if( rateSession == 0 || rateClient < rateSession )
+    return rateClient;
+  return rateSession;
+}
+
+// Share of the global limit of this instance in bytes/s: the limit divided
+// by the number of instances transferring, those which took tokens during
+// the current period of 1 s or the previous one. With use, this instance
+// counts as one of them.
+
+unsigned long FtpServer::rateShare( boolean use ){
+  uint32_t now = millis();
+  if( now - millisRatePeriod >= 1000 ){
+    // the previous period is forgotten too if nothing was sent since
+    rateUsersLast = now - millisRatePeriod < 2000 ? rateUsers : 0;
+    rateUsers = 0;
+    ratePeriod++;
+    millisRatePeriod = now;
+  }
+  if( use && rateSharePeriod != ratePeriod ){
+    rateSharePeriod = ratePeriod;
+    rateUsers++;
+  }
+  uint8_t users = rateUsers > rateUsersLast ? rateUsers : rateUsersLast;
+  unsigned long share = users > 1 ? rateGlobal / users : rateGlobal;
+  return share > 0 ? share : 1;
+}
+
+// Take as many tokens as possible, up to wanted, from the session bucket
+// and from the share of the global limit
+//
+//  return:
+//    number of bytes allowed to be transfered now (may be 0)
+
+unsigned long FtpServer::takeTokens( unsigned long wanted ){
+  unsigned long limit = rateLimit();
+  if( rateGlobal > 0 ){
+    refillBucket( &rateShareBucket, rateShare( wanted > 0 ));
+    if( wanted > rateShareBucket.tokens )
+      wanted = rateShareBucket.tokens;
+  }
+  if( limit > 0 ){
+    refillBucket( &rateBucket, limit );
+    if( wanted > rateBucket.tokens )
+      wanted = rateBucket.tokens;
+    rateBucket.tokens -= wanted;
+  }
+  if( rateGlobal > 0 )
+    rateShareBucket.tokens -= wanted;
+  return wanted;
+}
+
+// Time in ms until takeTokens() has bytes to give again, 0 if it has now
+
+uint32_t FtpServer::rateDelay(){
+  uint32_t wait = 0;
+  unsigned long limit = rateLimit();
+  if( limit > 0 ){
+    refillBucket( &rateBucket, limit );
+    if( rateBucket.tokens == 0 )
+      wait = ( 1000 - rateBucket.remainder + limit - 1 ) / limit;
+  }
+  if( rateGlobal > 0 ){
+    unsigned long share = rateShare( false );
+    refillBucket( &rateShareBucket, share );
+    if( rateShareBucket.tokens == 0 ){
+      uint32_t global = ( 1000 - rateShareBucket.remainder + share - 1 ) / share;
+      if( global > wait )
+        wait = global;
+    }
+  }
+  return wait;
+}
+
+// Add the tokens earned at limit bytes/s since the last refill. The fraction
+// of a token left is kept for the next refill, so that frequent calls don't
+// lower the rate.
+
+void FtpServer::refillBucket( FTP_BUCKET *bucket, unsigned long limit ){
+  uint32_t now = millis();
+  uint32_t elapsed = now - bucket->millisRefill;
+  bucket->millisRefill = now;
+  if( elapsed > 1000 )
+    elapsed = 1000;
+
+  uint64_t credit = (uint64_t) limit * elapsed + bucket->remainder;
+  bucket->tokens += (unsigned long)( credit / 1000 );
+  bucket->remainder = (uint32_t)( credit % 1000 );
+  // allow a burst of one buffer at most
+  if( bucket->tokens > FTP_BUF_SIZE ){
+    bucket->tokens = FTP_BUF_SIZE;
+    bucket->remainder = 0;
+  }
 }
 
 void FtpServer::abortTransfer(){
-  if( transferStatus > F_IDLE ){
-    data.stop(); 
+  if( transferStatus > F_IDLE || dataCommand != D_NONE ){
+    closeData();
     client_println( "426 Transfer aborted"  );
 #ifdef FTP_DEBUG
     Serial.println( "Transfer aborted!") ;
 #endif
   }
 
+  dataWait = false;
+  dataCommand = D_NONE;
   transferStatus = F_IDLE;
 }
 
+// One byte of the control connection, decrypted when TLS is on
+//
+//  return:
+//    -1 if none is available
+
+int16_t FtpServer::ctrlRead(){
+#if FTP_ENABLE_TLS
+  if( ctrlTls == TLS_ON ){
+    unsigned char c;
+    int r = mbedtls_ssl_read( &ctrlSsl, &c, 1 );
+    if( r == 1 )
+      return c;
+    if( r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE ){
+      // closed by the client or broken, handleStep() sees the disconnection
+      ctrlTls = TLS_OFF;
+      client.stop();
+    }
+    return -1;
+  }
+#endif
+  if( client.available() > 0 )
+    return client.read();
+  return -1;
+}
+
+// Bytes waiting on the data connection, still encrypted if not yet
+// decrypted when TLS is on
+
+int FtpServer::dataAvailable(){
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_ON && mbedtls_ssl_get_bytes_avail( &dataSsl ) > 0 )
+    return mbedtls_ssl_get_bytes_avail( &dataSsl );
+#endif
+  return data.available();
+}
+
+// Read up to len bytes from the data connection, without waiting
+//
+//  return:
+//    number of bytes read, 0 if none is available yet
+
+int FtpServer::dataRead( uint8_t *p, size_t len ){
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_ON ){
+    int r = mbedtls_ssl_read( &dataSsl, p, len );
+    if( r > 0 )
+      return r;
+    if( r != MBEDTLS_ERR_SSL_WANT_READ && r != MBEDTLS_ERR_SSL_WANT_WRITE ){
+      // end of the upload, answer the close_notify of the client
+      if( r == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY )
+        tlsClose( &dataSsl );
+      dataTls = TLS_OFF;
+      data.stop();
+    }
+    return 0;
+  }
+#endif
+  int r = data.read( p, len );
+  return r > 0 ? r : 0;
+}
+
+void FtpServer::dataWrite( const void *p, size_t len ){
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_ON ){
+    if( ! tlsWrite( &dataSsl, dataFd, p, len )){
+      dataTls = TLS_OFF;
+      data.stop();
+    }
+  }else
+#endif
+  data.write((const uint8_t*) p, len);
+#ifdef FTP_TRACE
+  trace(T_DATA_OUT, p, len);
+#endif
+}
+
+// false while the data connection is in its TLS handshake
+
+boolean FtpServer::dataReady(){
+#if FTP_ENABLE_TLS
+  return dataTls != TLS_HANDSHAKE;
+#else
+  return true;
+#endif
+}
+
+// Start TLS on the data connection after PROT P. doRetrieve(), doStore()
+// and doList() go on with the handshake between other work.
+
+void FtpServer::secureData(){
+#if FTP_ENABLE_TLS
+  if( ! dataProt )
+    return;
+
+  mbedtls_ssl_session_reset( &dataSsl );
+  dataFd = data.fd();
+  dataTls = TLS_HANDSHAKE;
+#endif
+}
+
+void FtpServer::closeData(){
+  // the client listens again on its PORT for the next transfer
+  activeAgain = ! dataPassiveConn;
+#if FTP_ENABLE_TLS
+  if( dataTls == TLS_ON )
+    tlsClose( &dataSsl );
+  dataTls = TLS_OFF;
+#endif
+  data.stop();
+#ifdef FTP_TRACE
+  trace(T_DATA_CLOSE, NULL, 0);
+#endif
+}
+
+#if FTP_ENABLE_TLS
+// Go on with the handshake of the data connection of RETR or STOR
+//
+//  return:
+//    false if it failed, the transfer is aborted then
+
+boolean FtpServer::dataHandshake(){
+  int8_t r = tlsHandshake( &dataSsl );
+  if( r > 0 ){
+    dataTls = TLS_ON;
+    return true;
+  }
+  if( r == 0 && data.connected() && millis() - millisBeginTrans < FTP_TLS_TIMEOUT )
+    return true;
+#ifdef FTP_DEBUG
+  Serial.println("data TLS handshake failed");
+#endif
+  abortTransfer();
+  return false;
+}
+
+// One step of a handshake, as far as the bytes received allow
+//
+//  return:
+//    1 if done, 0 if it goes on, -1 if it failed
+
+int8_t FtpServer::tlsHandshake( mbedtls_ssl_context *ssl ){
+  int r = mbedtls_ssl_handshake( ssl );
+  if( r == 0 )
+    return 1;
+  if( r == MBEDTLS_ERR_SSL_WANT_READ || r == MBEDTLS_ERR_SSL_WANT_WRITE )
+    return 0;
+#ifdef FTP_DEBUG
+  Serial.printf("TLS handshake error -0x%04x\n", (unsigned int) -r);
+#endif
+  return -1;
+}
+
+// Write the len bytes, waiting for the socket when it is full
+//
+//  return:
+//    false if the connection failed
+
+boolean FtpServer::tlsWrite( mbedtls_ssl_context *ssl, int fd, const void *p, size_t len ){
+  const unsigned char *b = (const unsigned char*) p;
+  while( len > 0 ){
+    int r = mbedtls_ssl_write( ssl, b, len );
+    if( r > 0 ){
+      b += r;
+      len -= r;
+    }else
+    if( r == MBEDTLS_ERR_SSL_WANT_WRITE || r == MBEDTLS_ERR_SSL_WANT_READ ){
+      if( ! fdReady( fd, r == MBEDTLS_ERR_SSL_WANT_WRITE, FTP_TLS_TIMEOUT ))
+        return false;
+    }else{
+      return false;
+    }
+  }
+  return true;
+}
+
+// Send close_notify, so that the peer knows the data ended here. A single
+// try, without waiting: if the socket is full, the peer only sees the
+// connection close.
+
+void FtpServer::tlsClose( mbedtls_ssl_context *ssl ){
+  mbedtls_ssl_close_notify( ssl );
+}
+#endif
+
+// Get the index-th file: the stored file first, if any, then the read-only ones
+//
+//  return:
+//    false if there are less than index + 1 files
+
+boolean FtpServer::getFile( uint8_t index, FTP_FILE *file ){
+  if( file_name[0] != '\0' ){
+    if( index == 0 ){
+      file->name = file_name;
+      file->data = file_buffer;
+      file->size = file_buffer_size;
+      file->stored = file_compressed ? file_stored_size : file_buffer_size;
+      file->timeInfo = &file_timeInfo;
+      file->readOnly = false;
+      file->compressed = file_compressed;
+      file->archive = false;
+      return true;
+    }
+    index--;
+  }
+#if FTP_ENABLE_SNAPSHOT
+  if( snapActive && index == roFileCount ){
+    file->name = snap.path;
+    file->data = snap.data;
+    file->size = snap.size;
+    file->stored = snap.stored;
+    file->timeInfo = &snap.timeInfo;
+    file->readOnly = true;
+    file->compressed = snap.compressed;
+    file->archive = false;
+    return true;
+  }
+#endif
+  if( index >= roFileCount )
+    return false;
+
+  FTP_ROFILE *ro = &roFiles[ index ];
+  file->name = ro->name;
+  file->data = ro->data;
+  file->size = ro->size;
+  file->stored = ro->size;
+  file->timeInfo = &ro->timeInfo;
+  file->readOnly = true;
+  file->compressed = false;
+  file->archive = false;
+  return true;
+}
+
+boolean FtpServer::findFile( const char *path, FTP_FILE *file ){
+  for( uint8_t i = 0; getFile( i, file ); i++ ){
+    if( strcmp( path, file->name ) == 0 )
+      return true;
+  }
+  return false;
+}
+
+// The stored file can't be changed while it is being retrieved, alone or in
+// an archive. A STOR of any name would replace it, DELE and RNFR only apply
+// to it.
+
+boolean FtpServer::isBusy(){
+  if( transferStatus != F_RETRIEVED || file_name[0] == '\0' )
+    return false;
+#if FTP_ENABLE_TAR
+  if( retrFile.archive ){
+    for( uint8_t i = 0; i < tarCount; i++ )
+      if( tarFiles[i].name == file_name )
+        return true;
+    return false;
+  }
+#endif
+  return retrFile.name == file_name;
+}
+
+// true if a STOR of path may begin at restart: anywhere in the stored file
+// after REST, only at its end when it is compressed
+
+boolean FtpServer::storRestart( const char *path, unsigned long restart ){
+  return restart == 0 || ( strcmp( path, file_name ) == 0 && restart <= file_buffer_size
+    && ( ! file_compressed || restart == file_buffer_size ));
+}
+
+#if FTP_ENABLE_TAR
+// <dir>.tar is an archive of the files under dir ("/.tar" for all files),
+// generated while it is sent. The directory name is written to dir
+// (FTP_CWD_SIZE bytes), which file->name then points to.
+//
+//  return:
+//    true if path is such an archive with at least one file
+
+boolean FtpServer::findTar( const char *path, FTP_FILE *file, char *dir ){
+  size_t len = strlen( path );
+  if( len < 5 || strcmp( &path[ len - 4 ], ".tar" ) != 0 || len - 4 >= FTP_CWD_SIZE )
+    return false;
+
+  memcpy( dir, path, len - 4 );
+  dir[ len - 4 ] = '\0';
+  if( len - 4 > 1 && dir[ len - 5 ] == '/' )
+    dir[ len - 5 ] = '\0';
+
+  FTP_FILE member;
+  const struct tm *timeInfo = NULL;
+  unsigned long size = 0;
+  for( uint8_t i = 0; getFile( i, &member ); i++ ){
+    if( tarMember( dir, member.name ) == NULL )
+      continue;
+    if( timeInfo == NULL )
+      timeInfo = member.timeInfo;
+    size += 512 + ( ( member.size + 511 ) & ~511UL );
+  }
+  if( timeInfo == NULL )
+    return false;
+
+  file->name = dir;
+  file->data = NULL;
+  file->size = size + 1024;   // two empty blocks at the end
+  file->stored = 0;
+  file->timeInfo = timeInfo;
+  file->readOnly = true;
+  file->compressed = false;
+  file->archive = true;
+  return true;
+}
+
+// Name of path in the archive of dir, NULL if path is not under dir
+
+const char *FtpServer::tarMember( const char *dir, const char *path ){
+  if( strcmp( dir, "/" ) == 0 )
+    return path + 1;
+  size_t len = strlen( dir );
+  if( strncmp( path, dir, len ) == 0 && path[ len ] == '/' )
+    return path + len + 1;
+  return NULL;
+}
+
+// Make the 512 bytes ustar header of file
+
+void FtpServer::tarHeader( char *header, const char *name, const FTP_FILE *file ){
+  memset( header, 0, 512 );
+  strncpy( header, name, 99 );
+  strcpy( &header[100], "0000444" );     // mode
+  strcpy( &header[108], "0000000" );     // uid
+  strcpy( &header[116], "0000000" );     // gid
+  snprintf( &header[124], 12, "%011lo", file->size );
+  struct tm t = *file->timeInfo;
+  snprintf( &header[136], 12, "%011lo", (unsigned long) mktime( &t ));
+  memset( &header[148], ' ', 8 );        // checksum is computed with spaces there
+  header[156] = '0';                     // regular file
+  memcpy( &header[257], "ustar", 6 );
+  memcpy( &header[263], "00", 2 );
+
+  unsigned int sum = 0;
+  for( int i = 0; i < 512; i++ )
+    sum += (uint8_t) header[i];
+  snprintf( &header[148], 7, "%06o", sum );
+  header[155] = ' ';
+}
+
+// Copy up to length bytes of the archive being retrieved from offset into
+// dst, made of the files kept in tarFiles when RETR began
+
+unsigned long FtpServer::readTarData( unsigned long offset, unsigned char *dst, unsigned long length ){
+  unsigned long pos = 0;
+  unsigned long n = 0;
+
+  for( uint8_t i = 0; n < length && i < tarCount; i++ ){
+    const FTP_FILE &file = tarFiles[ i ];
+    const char *name = tarMember( tarDir, file.name );
+
+    unsigned long entry = 512 + ( ( file.size + 511 ) & ~511UL );
+    while( n < length && offset + n < pos + entry ){
+      unsigned long at = offset + n - pos;
+      unsigned long take;
+      if( at < 512 ){
+        char header[ 512 ];
+        tarHeader( header, name, &file );
+        take = 512 - at;
+        if( take > length - n )
+          take = length - n;
+        memcpy( &dst[ n ], &header[ at ], take );
+      }else
+      if( at - 512 < file.size ){
+        // contents, straight from the file
+        take = file.size - ( at - 512 );
+        if( take > length - n )
+          take = length - n;
+        take = readFileData( &file, at - 512, &dst[ n ], take, &retrCursor );
+        if( take == 0 )
+          return n;
+      }else{
+        // padding to 512 bytes
+        take = pos + entry - ( offset + n );
+        if( take > length - n )
+          take = length - n;
+        memset( &dst[ n ], 0, take );
+      }
+      n += take;
+    }
+    pos += entry;
+  }
+
+  // end of archive
+  if( n < length && offset + n < pos + 1024 ){
+    unsigned long take = pos + 1024 - ( offset + n );
+    if( take > length - n )
+      take = length - n;
+    memset( &dst[ n ], 0, take );
+    n += take;
+  }
+
+  return n;
+}
+#endif
+
+// Append the nb bytes in buf to the stored file as one block, compressed
+// if that makes it smaller, and empty buf
+//
+//  return:
+//    false if file_buffer is full
+
+boolean FtpServer::storeBlock( uint16_t nb ){
+  unsigned long room = file_buffer_length - file_stored_size;
+  if( room <= 4 )
+    return false;
+  room -= 4;
+
+  unsigned char *block = &file_buffer[ file_stored_size ];
+  unsigned int stored = 0;
+#if FTP_ENABLE_COMPRESS
+  stored = lzCompress( (uint8_t*) buf, nb, block + 4, room < nb ? room : nb - 1 );
+#endif
+  if( stored == 0 ){
+    if( nb > room )
+      return false;
+    memcpy( block + 4, buf, nb );
+    stored = nb;
+  }
+  block[0] = nb & 0xff;
+  block[1] = nb >> 8;
+  block[2] = stored & 0xff;
+  block[3] = stored >> 8;
+  file_stored_size += 4 + stored;
+  file_buffer_size += nb;
+  bufFill = 0;
+  return true;
+}
+
+// Copy up to length bytes of file from offset into dst. For a compressed
+// file, cursor keeps the last block read, so that reading on from there
+// doesn't walk the blocks from the start again, and keeps it decompressed
+// when only a part of it was copied, for the next read to take the rest.
+//
+//  return:
+//    number of bytes copied, 0 at the end of file or if blocks are corrupt
+
+unsigned long FtpServer::readFileData( const FTP_FILE *file, unsigned long offset, unsigned char *dst, unsigned long length, FTP_CURSOR *cursor ){
+  if( offset >= file->size )
+    return 0;
+  if( length > file->size - offset )
+    length = file->size - offset;
+
+#if FTP_ENABLE_TAR
+  if( file->archive )
+    return readTarData( offset, dst, length );
+#endif
+  if( ! file->compressed ){
+    memcpy( dst, &file->data[ offset ], length );
+    return length;
+  }
+
+  // walk the blocks to the one holding offset
+  unsigned long pos = 0;
+  unsigned long begin = 0;
+  if( cursor->data == file->data && cursor->begin <= offset ){
+    pos = cursor->pos;
+    begin = cursor->begin;
+  }
+  unsigned long n = 0;
+  while( n < length && pos + 4 <= file->stored ){
+    const unsigned char *block = &file->data[ pos ];
+    uint16_t raw = block[0] | ( block[1] << 8 );
+    uint16_t stored = block[2] | ( block[3] << 8 );
+    if( pos + 4 + stored > file->stored || raw > FTP_BUF_SIZE )
+      break;
+
+    if( offset + n < begin + raw ){
+      if( cursor->data != file->data || cursor->pos != pos ){
+        cursor->data = file->data;
+        cursor->pos = pos;
+        cursor->begin = begin;
+#if FTP_ENABLE_COMPRESS
+        cursor->cached = false;
+#endif
+      }
+      unsigned long skip = offset + n - begin;
+      unsigned long take = raw - skip;
+      if( take > length - n )
+        take = length - n;
+      if( stored == raw ){
+        memcpy( &dst[ n ], &block[ 4 + skip ], take );
+      }else{
+#if FTP_ENABLE_COMPRESS
+        if( ! cursor->cached && skip == 0 && take == raw ){
+          // the whole block, straight into dst
+          if( lzDecompress( &block[4], stored, &dst[ n ], raw ) != raw )
+            break;
+        }else{
+          if( ! cursor->cached ){
+            if( lzDecompress( &block[4], stored, cursor->cache, raw ) != raw )
+              break;
+            cursor->cached = true;
+          }
+          memcpy( &dst[ n ], &cursor->cache[ skip ], take );
+        }
+#else
+        break;    // compressed blocks are only written with FTP_ENABLE_COMPRESS
+#endif
+      }
+      n += take;
+    }
+    pos += 4 + stored;
+    begin += raw;
+  }
+
+  return n;
+}
+
+boolean FtpServer::isReadOnly( const char *path ){
+  FTP_FILE file;
+  return findFile( path, &file ) && file.readOnly;
+}
+
 // Read a char from client connected to ftp server
 //
 //  update cmdLine and command buffers, iCL and parameters pointers
@@ -736,8 +2530,9 @@ void FtpServer::abortTransfer(){
 int8_t FtpServer::readChar(){
   int8_t rc = -1;
 
-  if( client.available()){
-    char c = client.read();
+  int16_t b = ctrlRead();
+  if( b >= 0 ){
+    char c = b;
 #ifdef FTP_DEBUG
     Serial.print( c);
 #endif
@@ -752,6 +2547,9 @@ int8_t FtpServer::readChar(){
           rc = -2; //  Line too long
       }else{
         cmdLine[ iCL ] = 0;
+#ifdef FTP_TRACE
+        trace(T_CTRL_IN, cmdLine, iCL);
+#endif
         command[ 0 ] = 0;
         parameters = NULL;
         // empty line?
@@ -765,17 +2563,20 @@ int8_t FtpServer::readChar(){
             if( parameters - cmdLine > 4 ){
               rc = -2; // Syntax error
             }else{
-              strncpy( command, cmdLine, parameters - cmdLine );
+              memcpy( command, cmdLine, parameters - cmdLine );
               command[ parameters - cmdLine ] = 0;
               
               while( * ( ++ parameters ) == ' ' )
                 ;
             }
-          }else
-          if( strlen( cmdLine ) > 4 )
-            rc = -2; // Syntax error.
-          else
-            strcpy( command, cmdLine );
+          }else{
+            // no parameters, point to an empty string
+            parameters = &cmdLine[ iCL ];
+            if( strlen( cmdLine ) > 4 )
+              rc = -2; // Syntax error.
+            else
+              strcpy( command, cmdLine );
+          }
           iCL = 0;
         }
       }
@@ -28,23 +28,120 @@
 // Uncomment to print debugging info to console attached to ESP8266
 //#define FTP_DEBUG
 
+// Uncomment to allow recording of sessions with setTrace()
+//#define FTP_TRACE
+
+// Uncomment to collect load statistics, see getStats() and printStats()
+//#define FTP_STATS
+
 #ifndef FTP_SERVERESP_H
 #define FTP_SERVERESP_H
 
 #include <WiFiClient.h>
+#include <WiFiServer.h>
 
 #define FTP_SERVER_VERSION "FTP-2016-01-14"
 
+// All settings below may be overridden from build_flags in platformio.ini,
+// e.g. -D FTP_BUF_SIZE=2048 -D FTP_ENABLE_MLSD=0
+
+#ifndef FTP_CTRL_PORT
 #define FTP_CTRL_PORT    21          // Command port on wich server is listening  
+#endif
+#ifndef FTP_DATA_PORT_PASV
 #define FTP_DATA_PORT_PASV 50009     // Data port in passive mode
+#endif
 
+#ifndef FTP_TIME_OUT
 #define FTP_TIME_OUT  5           // Disconnect client after 5 minutes of inactivity
+#endif
+#ifndef FTP_CMD_SIZE
 #define FTP_CMD_SIZE 255 + 8 // max size of a command
+#endif
+#ifndef FTP_CWD_SIZE
 #define FTP_CWD_SIZE 255 + 8 // max size of a directory name
+#endif
+#ifndef FTP_FIL_SIZE
 #define FTP_FIL_SIZE 255     // max size of a file name
+#endif
+#ifndef FTP_BUF_SIZE
 #define FTP_BUF_SIZE 1024 //512   // size of file buffer for read/write
+#endif
+
+#ifndef FTP_LINE_SIZE
+#define FTP_LINE_SIZE 320    // max size of a formatted reply or listing line
+#endif
+#ifndef FTP_CRED_SIZE
+#define FTP_CRED_SIZE 32     // max size of user name and password
+#endif
 
+#ifndef FNAME_LENGTH
 #define FNAME_LENGTH  64
+#endif
+
+#ifndef FTP_MAX_ROFILES
+#define FTP_MAX_ROFILES 4         // max number of read-only files added with addReadOnlyFile()
+#endif
+
+#ifndef FTP_ENABLE_COMPRESS
+#define FTP_ENABLE_COMPRESS 1     // setCompression()
+#endif
+
+#ifndef FTP_ENABLE_SNAPSHOT
+#define FTP_ENABLE_SNAPSHOT 1     // snapshot(), SITE SNAP
+#endif
+#ifndef FTP_ENABLE_TAR
+#define FTP_ENABLE_TAR 1          // RETR <dir>.tar
+#endif
+// An archive holds at most FTP_MAX_ROFILES + 2 members (6 by default): the
+// read-only files, the stored file and the snapshot, every file the server
+// has. Raise FTP_MAX_ROFILES to archive more, each one adds an FTP_ROFILE and
+// an FTP_FILE to the instance.
+#define FTP_SNAP_DIR  "/.snap/"   // snapshots are served as FTP_SNAP_DIR<name>/<file>
+#define FTP_SNAP_NAME_SIZE 16     // max size of a snapshot name
+
+#ifndef FTP_WAIT_SLICE
+#define FTP_WAIT_SLICE 20         // ms between checks for new connections in waitFTP()
+#endif
+// Define FTP_WAIT_EPOLL (Linux host build only, see tools/host) for a
+// waitFTP() sleeping in epoll on the listening socket too
+//#define FTP_WAIT_EPOLL
+
+#ifndef FTP_RATE_LIMIT
+#define FTP_RATE_LIMIT 0          // default data transfer limit in bytes/s (0 = unlimited)
+#endif
+
+#ifndef FTP_ENABLE_TLS
+#define FTP_ENABLE_TLS 0          // AUTH TLS, PBSZ, PROT with mbedTLS, see setCertificate()
+#endif
+#ifndef FTP_TLS_TIMEOUT
+#define FTP_TLS_TIMEOUT 10000     // ms allowed for a TLS handshake
+#endif
+#define FTP_TLS_TICKET_LIFETIME 86400   // s a session ticket may be used to resume
+
+// Optional command families, set to 0 to leave them out of the build
+// (tools/host/size_report.sh compares the builds with and without them)
+#ifndef FTP_ENABLE_LIST
+#define FTP_ENABLE_LIST   1       // LIST, NLST
+#endif
+#ifndef FTP_ENABLE_MLSD
+#define FTP_ENABLE_MLSD   1       // MLSD
+#endif
+#ifndef FTP_ENABLE_RENAME
+#define FTP_ENABLE_RENAME 1       // RNFR, RNTO
+#endif
+#ifndef FTP_ENABLE_DELETE
+#define FTP_ENABLE_DELETE 1       // DELE
+#endif
+
+#if FTP_ENABLE_TLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#endif
 
 typedef enum{
   F_IDLE = 0,
@@ -54,60 +151,394 @@ typedef enum{
   F_RENAMED
 } FTP_F_STATUS;
 
+// Read-only copy of the stored file, sharing file_buffer until it changes
+typedef struct{
+  char path[ sizeof(FTP_SNAP_DIR) + FTP_SNAP_NAME_SIZE + FNAME_LENGTH ];
+  const unsigned char *data;        // file_buffer while shared, else the snapshot buffer
+  unsigned long size;
+  unsigned long stored;
+  boolean compressed;
+  struct tm timeInfo;
+} FTP_SNAPSHOT;
+
+// Status of the control connection
+typedef enum{
+  C_DISCONNECT = 0,   // disconnect the client
+  C_INIT,             // reset the session
+  C_IDLE,             // waiting for a client
+  C_USER,             // waiting for USER
+  C_PASS,             // waiting for PASS
+  C_COMMAND           // logged in, waiting for commands
+} FTP_C_STATUS;
+
+// Data command accepted, waiting for its data connection
+typedef enum{
+  D_NONE = 0,
+  D_LIST,
+  D_MLSD,
+  D_NLST,
+  D_RETR,
+  D_STOR
+} FTP_D_COMMAND;
+
+#if FTP_ENABLE_TLS
+// Status of TLS on a connection
+typedef enum{
+  TLS_OFF = 0,        // clear
+  TLS_HANDSHAKE,      // handshake in progress
+  TLS_ON
+} FTP_TLS_STATUS;
+#endif
+
+// File as seen by the commands: the stored file or a read-only one
+typedef struct{
+  const char *name;
+  const unsigned char *data;
+  unsigned long size;               // size of the file contents
+  unsigned long stored;             // bytes used at data
+  const struct tm *timeInfo;
+  boolean readOnly;
+  boolean compressed;               // data holds FtpLz blocks
+  boolean archive;                  // tar of the files under the directory name, made on the fly
+} FTP_FILE;
+
+typedef struct{
+  char name[ FNAME_LENGTH ];
+  const unsigned char *data;
+  unsigned long size;
+  struct tm timeInfo;
+} FTP_ROFILE;
+
+// Where reading a compressed file stopped, to go on from there
+typedef struct{
+  const unsigned char *data;        // data of the file, NULL if not set
+  unsigned long pos;                // offset of the last block read in data
+  unsigned long begin;              // offset of its first byte in the file contents
+#if FTP_ENABLE_COMPRESS
+  boolean cached;                   // cache holds that block decompressed
+  unsigned char cache[ FTP_BUF_SIZE ];
+#endif
+} FTP_CURSOR;
+
+// Token bucket of a rate limit
+typedef struct{
+  unsigned long tokens;             // bytes that may be sent/received right now
+  uint32_t remainder;               // fraction of a token left by the last refill, in 1/1000
+  uint32_t millisRefill;            // last refill
+} FTP_BUCKET;
+
+#ifdef FTP_STATS
+#define FTP_HIST_BUCKETS 24       // bucket i counts values in [2^(i-1), 2^i), last one is open
+
+typedef struct{
+  uint32_t connections;           // control connections accepted
+  uint32_t replaced;              // control connections dropped for a new client
+  uint32_t dataRefused;           // commands answered "425 No data connection"
+  uint32_t commands;              // command lines processed
+  uint32_t cmdHist[ FTP_HIST_BUCKETS ];   // command processing time in us
+  uint32_t callHist[ FTP_HIST_BUCKETS ];  // duration of handleFTP() calls in us
+  uint32_t dataConnects;          // calls to dataConnect()
+  uint32_t dataConnectMillis;     // total time spent in dataConnect()
+  uint32_t bytesSent;             // data bytes sent by RETR
+  uint32_t bytesReceived;         // data bytes received by STOR
+  uint32_t millisBegin;           // time of the last resetStats()
+} FTP_STATISTICS;
+#endif
+
+#ifdef FTP_TRACE
+// Trace record, written little endian to the Print given to setTrace():
+//   uint8_t  type      (FTP_T_TYPE)
+//   uint32_t micros    time since setTrace() was called (wraps after 71 min)
+//   uint16_t length    length of the payload following the header
+//   payload            bytes sent or received (empty for connection events)
+typedef enum{
+  T_CTRL_IN = 0,    // one command line received, without CR/LF
+  T_CTRL_OUT,       // one reply line sent, without CR/LF
+  T_DATA_IN,        // bytes received on the data connection
+  T_DATA_OUT,       // bytes sent on the data connection
+  T_CTRL_OPEN,      // client connected
+  T_CTRL_CLOSE,     // client disconnected
+  T_DATA_OPEN,      // data connection established
+  T_DATA_CLOSE      // data connection closed
+} FTP_T_TYPE;
+
+#define FTP_TRACE_HEADER_SIZE 7
+#endif
+
 class FtpServer{
 public:
-  void    begin(unsigned char *p_buffer, unsigned long length);
-  void    begin(String uname, String pword, unsigned char *p_buffer, unsigned long length);
-  FTP_F_STATUS  handleFTP();
+  // Several servers may run side by side when given different ports.
+  // Each one serves a single session with one data connection: a segmented
+  // download (several connections fetching ranges of a file with REST and
+  // RETR) takes one instance per segment, each serving the same bytes added
+  // with addReadOnlyFile(), which are read in place, not copied. The stored
+  // file belongs to a single instance. See tools/host/bench_segments.
+  FtpServer(uint16_t ctrl_port = FTP_CTRL_PORT, uint16_t pasv_port = FTP_DATA_PORT_PASV);
+
+  // Start listening, with the login of uname and pword (anonymous and any
+  // password without them)
+  //  return: false, without starting, if uname or pword is FTP_CRED_SIZE
+  //          characters or more
+  boolean begin(unsigned char *p_buffer, unsigned long length);
+  boolean begin(const char *uname, const char *pword, unsigned char *p_buffer, unsigned long length);
+  boolean begin(const String &uname, const String &pword, unsigned char *p_buffer, unsigned long length);
+  // Serve the client. With budget_us > 0, go on with pending work (command
+  // bytes, transfer buffers) for about that many microseconds before
+  // returning; a transfer in progress resumes on the next call.
+  FTP_F_STATUS  handleFTP(uint32_t budget_us = 0);
+  // Block until handleFTP() has work, or timeout ms (false if timed out)
+  boolean waitFTP(uint32_t timeout);
   void setFile(const char *fname, unsigned long size);
+  // Serve size bytes at data (e.g. a const array in flash) as a read-only
+  // file, without copying them. The bytes must stay valid until the file
+  // is removed. RETR, SIZE, MDTM and listings serve it like the stored
+  // file; STOR, DELE and RNFR/RNTO on its name fail with 550/553.
+  //  return: false if the name is in use or too long, or the table is full
+  boolean addReadOnlyFile(const char *fname, const unsigned char *data, unsigned long size);
+  boolean removeReadOnlyFile(const char *fname);
+#if FTP_ENABLE_COMPRESS
+  // Compress files received by STOR into file_buffer, in blocks of at most
+  // FTP_BUF_SIZE bytes each preceded by their raw and stored lengths (16 bits
+  // little endian, equal when the block is not compressed). file_buffer_size
+  // stays the uncompressed size; use readFile() to get the contents.
+  void setCompression(boolean enable);
+#endif
+#if FTP_ENABLE_SNAPSHOT
+  // Freeze the stored file in O(1) as a read-only snapshot, retrievable as
+  // FTP_SNAP_DIR<name>/<file> until releaseSnapshot(). The snapshot shares
+  // file_buffer; only when bytes of it are about to be overwritten are they
+  // copied to the buffer given to setSnapshotBuffer(). Appending after them
+  // copies nothing. snapshot() fails without that buffer, or if the file
+  // doesn't fit in it.
+  // There is a single snapshot per instance, without reference counts:
+  // snapshot() fails while one is held, and releaseSnapshot() drops it even
+  // if a client is reading it (that RETR is aborted). The snapshot buffer
+  // must hold the whole stored file, as a write anywhere in it copies all of
+  // it. A snapshot costs sizeof(FTP_SNAPSHOT) in the instance, plus that
+  // copy once the file is overwritten (tools/host/test_snapshot).
+  void setSnapshotBuffer(unsigned char *p_buffer, unsigned long length);
+  boolean snapshot(const char *name);
+  boolean releaseSnapshot();
+#endif
+  // Call before changing file_buffer from the application (before setFile()),
+  // with the offset of the first byte to change
+  //  return: false if a snapshot still needs the bytes or a RETR is sending
+  //          them, do not write then
+  boolean prepareWrite(unsigned long offset = 0);
+  // Copy up to length bytes of the stored file from offset into dst,
+  // decompressing them if needed
+  //  return: number of bytes copied
+  unsigned long readFile(unsigned long offset, unsigned char *dst, unsigned long length);
+  // Token bucket limit for data transfers in bytes/s (0 = unlimited).
+  // The global limit is shared by all the server instances, whose transfers
+  // together stay under it: each of the n instances transferring gets
+  // limit / n, so that a fast client can't starve the others (a share left
+  // unused by a slow client is not given to them). The session limit applies
+  // to this one only; a client may lower it for itself with SITE RATE, never
+  // raise it.
+  static void setGlobalRateLimit(unsigned long bytesPerSec);
+  void setRateLimit(unsigned long bytesPerSec);
+#if FTP_ENABLE_TLS
+  // Offer AUTH TLS (RFC 4217) with this certificate chain and private key,
+  // PEM encoded (they are parsed, no need to keep them). After PROT P the
+  // data connections are secured too, resuming the session of the control
+  // connection with a session ticket so that only its handshake is a full
+  // one. With required, USER is refused until the client has sent AUTH TLS.
+  // Call once, after begin().
+  //  return: false if the certificate or the key can't be used
+  boolean setCertificate(const char *cert_pem, const char *key_pem, boolean required = false);
+#endif
+#ifdef FTP_STATS
+  const FTP_STATISTICS &getStats() const { return stats; }
+  void resetStats();
+  // Write the statistics as one JSON line, with command latency percentiles
+  void printStats(Print &out);
+#endif
+#ifdef FTP_TRACE
+  // Record the session into out (NULL to stop recording). The trace holds
+  // every command line, PASS included. Replay it with tools/host/ftp_replay.
+  void setTrace(Print *out);
+#endif
 
   char file_name[FNAME_LENGTH];
   unsigned long file_buffer_size;
   struct tm file_timeInfo;
 
 private:
-  void client_println(String text);
-  void data_println(String text);
-  String toDateTimeStr(int type);
+  void client_println(const char *text);
+  void client_printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+  void data_println(const char *text);
+  void data_printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+  char *toDateTimeStr(char *datetime_str, const struct tm *timeInfo, int type);
 
+  FTP_F_STATUS handleStep();
+  boolean hasWork();
+  boolean ctrlAvailable();
+  uint32_t timeToEvent();
   void    iniVariables();
   void    clientConnected();
   void    disconnectClient();
   boolean userIdentity();
   boolean userPassword();
+  boolean securityCommand();
   boolean processCommand();
   boolean dataConnect();
+  void    beginData();
+  void    cancelData();
+  void    beginTransfer();
+  void    doList();
+  void    startActive();
+  void    closeActive();
+  boolean waitActive( uint32_t timeout );
+  boolean fdReady( int fd, boolean write, uint32_t timeout );
   boolean doRetrieve();
   boolean doStore();
+  int16_t ctrlRead();
+  int     dataAvailable();
+  int     dataRead( uint8_t *p, size_t len );
+  void    dataWrite( const void *p, size_t len );
+  boolean dataReady();
+  void    secureData();
+  void    closeData();
+#if FTP_ENABLE_TLS
+  boolean dataHandshake();
+  int8_t  tlsHandshake( mbedtls_ssl_context *ssl );
+  boolean tlsWrite( mbedtls_ssl_context *ssl, int fd, const void *p, size_t len );
+  void    tlsClose( mbedtls_ssl_context *ssl );
+#endif
   void    closeTransfer();
   void    abortTransfer();
   boolean makePath( char * fullname );
   boolean makePath( char * fullName, char * param );
   int8_t  readChar();
+  boolean getFile( uint8_t index, FTP_FILE *file );
+  boolean findFile( const char *path, FTP_FILE *file );
+  boolean isReadOnly( const char *path );
+  boolean isBusy();
+  boolean storRestart( const char *path, unsigned long restart );
+  boolean storeBlock( uint16_t nb );
+#if FTP_ENABLE_TAR
+  boolean findTar( const char *path, FTP_FILE *file, char *dir );
+  const char *tarMember( const char *dir, const char *path );
+  void    tarHeader( char *header, const char *name, const FTP_FILE *file );
+  unsigned long readTarData( unsigned long offset, unsigned char *dst, unsigned long length );
+#endif
+  unsigned long readFileData( const FTP_FILE *file, unsigned long offset, unsigned char *dst, unsigned long length, FTP_CURSOR *cursor );
+  unsigned long rateLimit();
+  unsigned long takeTokens(unsigned long wanted);
+  uint32_t rateDelay();
+  unsigned long rateShare(boolean use);
+  static void refillBucket(FTP_BUCKET *bucket, unsigned long limit);
+#ifdef FTP_STATS
+  static void histAdd(uint32_t *hist, uint32_t value);
+  static uint32_t histPercentile(const uint32_t *hist, uint32_t permille);
+#endif
+#ifdef FTP_TRACE
+  void trace(FTP_T_TYPE type, const void *payload, uint16_t length);
+#endif
+
+  WiFiServer ctrlServer;
+  WiFiServer dataServer;
+  uint16_t   ctrlPort;               // command port
+  uint16_t   pasvPort;               // data port in passive mode
 
   IPAddress  dataIp;              // IP address of client for data
   WiFiClient client;
   WiFiClient data;
   
   boolean  dataPassiveConn;
+  boolean  dataWait;                  // command waiting for its data connection
+  FTP_D_COMMAND dataCommand;          // that command
+  uint32_t millisDataWait;            // begin of the wait
+  int      activeFd;                  // socket of an active mode connection in progress, or -1
+#ifdef FTP_WAIT_EPOLL
+  int      epollFd;                   // epoll set of waitFTP(), or -1
+  int      epollListen;               // listening socket in it, or -1
+#endif
+  boolean  activeAgain;               // connect again to the PORT of the last transfer
   uint16_t dataPort;
   char     buf[ FTP_BUF_SIZE ];       // data buffer for transfers
+  uint16_t bufFill;                   // bytes of buf waiting to be stored as a compressed block
   char     cmdLine[ FTP_CMD_SIZE ];   // where to store incoming char from client
   char     cwdName[ FTP_CWD_SIZE ];   // name of current directory
   char     command[ 5 ];              // command sent by client
+#if FTP_ENABLE_RENAME
   boolean  rnfrCmd;                   // previous command was RNFR
+#endif
   char *   parameters;                // point to begin of parameters sent by client
   uint16_t iCL;                       // pointer to cmdLine next incoming char
-  int8_t   cmdStatus;                 // status of ftp command connexion
+  FTP_C_STATUS cmdStatus;             // status of ftp command connexion
   FTP_F_STATUS transferStatus;            // status of ftp data transfer
   uint32_t millisTimeOut,             // disconnect after 5 min of inactivity
            millisDelay,
            millisEndConnection,       // 
            millisBeginTrans,          // store time of beginning of a transaction
            bytesTransfered;           //
-  String   _FTP_USER;
-  String   _FTP_PASS;
+  unsigned long rateSession;          // session limit set by the application in bytes/s (0 = unlimited)
+  unsigned long rateClient;           // limit asked by the client with SITE RATE (0 = none)
+  FTP_BUCKET rateBucket;              // tokens of the session limit
+  static unsigned long rateGlobal;    // global limit in bytes/s (0 = unlimited)
+  FTP_BUCKET rateShareBucket;         // tokens of the share of the global limit
+  uint32_t rateSharePeriod;           // last period this instance took tokens in
+  static uint32_t ratePeriod;         // number of the current period of the global limit
+  static uint32_t millisRatePeriod;   // its begin
+  static uint8_t rateUsers;           // instances which took tokens in it
+  static uint8_t rateUsersLast;       // and in the previous one
+#if FTP_ENABLE_TLS
+  boolean  tlsReady;                  // setCertificate() succeeded
+  boolean  tlsRequired;               // refuse USER before AUTH TLS
+  FTP_TLS_STATUS ctrlTls;             // TLS on the control connection
+  FTP_TLS_STATUS dataTls;             // TLS on the data connection
+  boolean  dataProt;                  // PROT P: secure the data connections
+  int      ctrlFd;                    // sockets of the TLS contexts
+  int      dataFd;
+  mbedtls_entropy_context tlsEntropy;
+  mbedtls_ctr_drbg_context tlsDrbg;
+  mbedtls_x509_crt tlsCert;
+  mbedtls_pk_context tlsKey;
+  mbedtls_ssl_config tlsConf;
+#if defined(MBEDTLS_SSL_TICKET_C)
+  mbedtls_ssl_ticket_context tlsTicket;
+#endif
+  mbedtls_ssl_context ctrlSsl;
+  mbedtls_ssl_context dataSsl;
+#endif
+#ifdef FTP_STATS
+  FTP_STATISTICS stats;
+#endif
+#ifdef FTP_TRACE
+  Print *  traceOut;                  // where to write trace records, or NULL
+  uint32_t microsTraceBegin;          // time of setTrace()
+#endif
+  char     _FTP_USER[ FTP_CRED_SIZE ];
+  char     _FTP_PASS[ FTP_CRED_SIZE ];
+
+  FTP_FILE retrFile;                  // file being retrieved
+  unsigned long retrOffset;           // offset of the first byte sent
+  unsigned long retrSize;             // number of bytes to send
+  char     storPath[ FNAME_LENGTH ];  // file to store
+  unsigned long storOffset;           // where the stored bytes go
+#if FTP_ENABLE_TAR
+  char     tarDir[ FTP_CWD_SIZE ];    // directory of the tar being retrieved
+  FTP_FILE tarFiles[ FTP_MAX_ROFILES + 2 ];   // its files, as when RETR began
+  uint8_t  tarCount;
+#endif
+  unsigned long restartOffset;        // offset given by REST for the next transfer
+
+  FTP_ROFILE roFiles[ FTP_MAX_ROFILES ];
+  uint8_t  roFileCount;
 
+#if FTP_ENABLE_SNAPSHOT
+  FTP_SNAPSHOT snap;
+  boolean  snapActive;                // snap holds a snapshot
+  unsigned char *snapBuffer;          // where to copy a shared snapshot on write
+  unsigned long snapBufferLength;
+#endif
+  boolean  compression;               // compress the next STOR
+  boolean  file_compressed;           // file_buffer holds compressed blocks
+  FTP_CURSOR readCursor;              // for readFile()
+  FTP_CURSOR retrCursor;              // for the file being retrieved
+  unsigned long file_stored_size;     // bytes used in file_buffer when compressed
   unsigned long file_buffer_length;
   unsigned char *file_buffer;
 };
@@ -0,0 +1,128 @@
+/*
+ * Small LZ77 codec (LZF stream format) for the FTP server file buffer
+ */
+
+#include "FtpLz.h"
+
+#include <string.h>
+
+#define LZ_HLOG      9            // 2^9 entries hash table
+#define LZ_MAX_LIT   32           // max length of a literal run
+#define LZ_MAX_OFF   8192         // max distance of a match
+#define LZ_MAX_REF   ( 7 + 255 + 2 )  // max length of a match
+
+unsigned int lzCompress( const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_len ){
+  uint16_t htab[ 1 << LZ_HLOG ];    // last position + 1 of each hashed 3 bytes, 0 if none
+  unsigned int ip = 0;
+  unsigned int op = 1;              // out[0] is kept for the length of the first literal run
+  unsigned int lit = 0;
+
+  if( in_len == 0 || out_len < 2 )
+    return 0;
+  memset( htab, 0, sizeof(htab) );
+
+  while( ip + 2 < in_len ){
+    uint32_t v = ( (uint32_t) in[ ip ] << 16 ) | ( in[ ip + 1 ] << 8 ) | in[ ip + 2 ];
+    unsigned int h = (uint32_t)( v * 2654435761U ) >> ( 32 - LZ_HLOG );
+    unsigned int ref = htab[ h ];
+    htab[ h ] = ip + 1;
+
+    if( ref > 0 && ip - ref < LZ_MAX_OFF
+      && in[ ref - 1 ] == in[ ip ] && in[ ref ] == in[ ip + 1 ] && in[ ref + 1 ] == in[ ip + 2 ] ){
+      unsigned int off = ip - ref;
+      unsigned int maxlen = in_len - ip;
+      if( maxlen > LZ_MAX_REF )
+        maxlen = LZ_MAX_REF;
+      unsigned int len = 3;
+      while( len < maxlen && in[ ref - 1 + len ] == in[ ip + len ] )
+        len++;
+
+      // close the current literal run
+      if( lit > 0 )
+        out[ op - lit - 1 ] = lit - 1;
+      else
+        op--;
+      if( op + 3 + 1 > out_len )
+        return 0;
+
+      unsigned int l = len - 2;
+      if( l < 7 ){
+        out[ op++ ] = ( off >> 8 ) + ( l << 5 );
+      }else{
+        out[ op++ ] = ( off >> 8 ) + ( 7 << 5 );
+        out[ op++ ] = l - 7;
+      }
+      out[ op++ ] = off & 0xff;
+
+      op++;                         // next literal run length
+      lit = 0;
+      ip += len;
+      continue;
+    }
+
+    if( op >= out_len )
+      return 0;
+    out[ op++ ] = in[ ip++ ];
+    if( ++lit == LZ_MAX_LIT ){
+      out[ op - lit - 1 ] = lit - 1;
+      lit = 0;
+      op++;
+    }
+  }
+
+  while( ip < in_len ){
+    if( op >= out_len )
+      return 0;
+    out[ op++ ] = in[ ip++ ];
+    if( ++lit == LZ_MAX_LIT ){
+      out[ op - lit - 1 ] = lit - 1;
+      lit = 0;
+      op++;
+    }
+  }
+
+  if( lit > 0 )
+    out[ op - lit - 1 ] = lit - 1;
+  else
+    op--;
+
+  return op;
+}
+
+unsigned int lzDecompress( const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_len ){
+  unsigned int ip = 0;
+  unsigned int op = 0;
+
+  while( ip < in_len ){
+    unsigned int ctrl = in[ ip++ ];
+
+    if( ctrl < LZ_MAX_LIT ){
+      // literal run
+      unsigned int len = ctrl + 1;
+      if( ip + len > in_len || op + len > out_len )
+        return 0;
+      memcpy( &out[ op ], &in[ ip ], len );
+      ip += len;
+      op += len;
+    }else{
+      // match
+      unsigned int len = ctrl >> 5;
+      if( len == 7 ){
+        if( ip >= in_len )
+          return 0;
+        len += in[ ip++ ];
+      }
+      if( ip >= in_len )
+        return 0;
+      unsigned int off = ( ( ctrl & 0x1f ) << 8 ) + in[ ip++ ] + 1;
+      len += 2;
+      if( off > op || op + len > out_len )
+        return 0;
+      // byte by byte, the match may overlap what it produces
+      for( unsigned int i = 0; i < len; i++, op++ )
+        out[ op ] = out[ op - off ];
+    }
+  }
+
+  return op;
+}
@@ -0,0 +1,30 @@
+/*
+ * Small LZ77 codec (LZF stream format) for the FTP server file buffer
+ *
+ * Compressed stream: a sequence of
+ *   000lllll                    l + 1 literal bytes follow
+ *   LLLooooo oooooooo           match of L + 2 bytes, offset o + 1 back
+ *   111ooooo LLLLLLLL oooooooo  match of L + 9 bytes, offset o + 1 back
+ *
+ * Works on whole blocks, with a 1 KB hash table on the stack and no other
+ * working memory.
+ */
+
+#ifndef FTP_LZ_H
+#define FTP_LZ_H
+
+#include <stdint.h>
+
+// Compress in_len bytes of in into out
+//
+//  return:
+//    compressed length, or 0 if it doesn't fit in out_len bytes
+unsigned int lzCompress( const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_len );
+
+// Decompress in_len bytes of in into out
+//
+//  return:
+//    decompressed length, or 0 if the data is corrupt or doesn't fit in out_len bytes
+unsigned int lzDecompress( const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_len );
+
+#endif // FTP_LZ_H
@@ -36,7 +36,8 @@ void setup() {
 }
 
 void loop() {
-  FTP_F_STATUS status = ftpSrv.handleFTP();        //make sure in loop you call handleFTP()!!   
+  ftpSrv.waitFTP(1000);                           //sleep until there is something to do (optional)
+  FTP_F_STATUS status = ftpSrv.handleFTP(10000);  //make sure in loop you call handleFTP()!!   
   if( status != F_IDLE ){
     Serial.print("status="); Serial.println(status); Serial.println(ftpSrv.file_name); Serial.println((char*)buffer);
   }
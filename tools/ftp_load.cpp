@@ -0,0 +1,682 @@
+/*
+ * Load generator for the FTP server
+ *
+ * Runs on a Linux (POSIX) host against a device, or any FTP server. Opens
+ * many control sessions at once, each running a random mix of LIST, SIZE,
+ * RETR, STOR and DELE, and prints the results as one JSON line so that runs
+ * can be compared across versions.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -pthread -o ftp_load tools/ftp_load.cpp
+ * or, for -T, with OpenSSL:
+ *   g++ -std=c++11 -O2 -pthread -DFTP_LOAD_TLS -o ftp_load tools/ftp_load.cpp -lssl -lcrypto
+ *
+ * Usage:
+ *   ftp_load [options] host
+ *     -p port[,port...]  control ports, sessions are spread over them (21)
+ *     -u user -w pass    login (anonymous, empty password)
+ *     -c sessions        sessions running at the same time (4)
+ *     -n count           operations per session (100)
+ *     -m mix             weights of the operations (list=1,size=2,retr=4,stor=2,dele=1)
+ *     -s bytes           size of the files stored by STOR (1024)
+ *     -f path            file for SIZE and RETR (the one the session stores)
+ *     -t ms              reply timeout (10000)
+ *     -a                 active mode: PORT to a port the session listens on,
+ *                        instead of PASV
+ *     -T                 AUTH TLS and PROT P, certificates are not verified
+ *     -R                 with -T, full handshake on every data connection
+ *                        instead of resuming the session of the control one
+ *
+ * Output:
+ *   refused      connections that failed or were closed before the welcome
+ *   dropped      sessions closed by the server while in use
+ *   cmdP*us      latency of every command, from sending it to its final
+ *                reply (for transfers, the reply after the data is through)
+ *   dataConnect* time from a transfer command to its 150 reply, which is
+ *                what the server spends in dataConnect(), in passive or
+ *                active mode (-a)
+ *   <op>         count, failures and latency percentiles of each operation
+ *   ctrlTls*     with -T, time of the handshake after AUTH TLS
+ *   dataTls*     with -T, time of the handshakes of the data connections,
+ *                resumed of which were resumptions
+ */
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef FTP_LOAD_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+static SSL_CTX *sslCtx;
+#endif
+
+enum{ OP_LIST = 0, OP_SIZE, OP_RETR, OP_STOR, OP_DELE, OP_COUNT };
+static const char *opNames[ OP_COUNT ] = { "list", "size", "retr", "stor", "dele" };
+
+struct Options{
+  std::string host;
+  std::vector<uint16_t> ports;
+  std::string user = "anonymous";
+  std::string pass = "";
+  int sessions = 4;
+  int count = 100;
+  int weights[ OP_COUNT ] = { 1, 2, 4, 2, 1 };
+  size_t storSize = 1024;
+  std::string file;
+  int timeout = 10000;
+  bool active = false;
+  bool tls = false;
+  bool resume = true;
+};
+
+struct Results{
+  uint32_t refused = 0;
+  uint32_t dropped = 0;
+  uint64_t bytes = 0;
+  std::vector<uint32_t> cmd;              // us
+  std::vector<uint32_t> dataConnect;      // us
+  std::vector<uint32_t> op[ OP_COUNT ];   // us
+  uint32_t failed[ OP_COUNT ] = { 0 };
+  std::vector<uint32_t> ctrlTls;          // us
+  std::vector<uint32_t> dataTls;          // us
+  uint32_t resumed = 0;
+
+  void add( const Results &r ){
+    refused += r.refused;
+    dropped += r.dropped;
+    bytes += r.bytes;
+    resumed += r.resumed;
+    cmd.insert( cmd.end(), r.cmd.begin(), r.cmd.end() );
+    dataConnect.insert( dataConnect.end(), r.dataConnect.begin(), r.dataConnect.end() );
+    ctrlTls.insert( ctrlTls.end(), r.ctrlTls.begin(), r.ctrlTls.end() );
+    dataTls.insert( dataTls.end(), r.dataTls.begin(), r.dataTls.end() );
+    for( int i = 0; i < OP_COUNT; i++ ){
+      op[ i ].insert( op[ i ].end(), r.op[ i ].begin(), r.op[ i ].end() );
+      failed[ i ] += r.failed[ i ];
+    }
+  }
+};
+
+static uint64_t nowUs(){
+  struct timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Connect to addr within timeout ms
+//
+//  return:
+//    socket, or -1 if failed
+
+static int tcpConnect( const struct sockaddr_in *addr, int timeout ){
+  int fd = socket( AF_INET, SOCK_STREAM, 0 );
+  if( fd < 0 )
+    return -1;
+  int one = 1;
+  setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  int flags = fcntl( fd, F_GETFL, 0 );
+  fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+  if( connect( fd, (const struct sockaddr*) addr, sizeof(*addr) ) < 0 ){
+    struct pollfd p = { fd, POLLOUT, 0 };
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if( errno != EINPROGRESS || poll( &p, 1, timeout ) <= 0
+      || getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 || err != 0 ){
+      close( fd );
+      return -1;
+    }
+  }
+  fcntl( fd, F_SETFL, flags );
+  return fd;
+}
+
+// One control session
+
+class Session{
+public:
+  Session( const Options &opt, int id, uint16_t port, Results &res )
+    : opt( opt ), id( id ), port( port ), res( res ), ctrl( -1 ), rng( id * 7919 + 1 ){
+#ifdef FTP_LOAD_TLS
+    ctrlSsl = NULL;
+#endif
+    char name[ 32 ];
+    snprintf( name, sizeof(name), "/load%d.bin", id );
+    ownFile = name;
+    payload.resize( opt.storSize );
+    for( size_t i = 0; i < payload.size(); i++ )
+      payload[ i ] = (char)( 'a' + ( i + id ) % 26 );
+  }
+
+  void run(){
+    int total = 0;
+    for( int i = 0; i < OP_COUNT; i++ )
+      total += opt.weights[ i ];
+
+    for( int n = 0; n < opt.count; n++ ){
+      if( ctrl < 0 && ! login() ){
+        res.refused++;
+        usleep( 10000 );
+        continue;
+      }
+      int pick = std::uniform_int_distribution<int>( 0, total - 1 )( rng );
+      int op = 0;
+      while( pick >= opt.weights[ op ] )
+        pick -= opt.weights[ op++ ];
+
+      uint64_t begin = nowUs();
+      int code = runOp( op );
+      if( code < 0 ){
+        // lost the control connection
+        res.dropped++;
+        res.failed[ op ]++;
+        closeCtrl();
+      }else
+      if( code >= 400 ){
+        res.failed[ op ]++;
+      }else{
+        res.op[ op ].push_back( (uint32_t)( nowUs() - begin ));
+      }
+    }
+    if( ctrl >= 0 ){
+      command( "QUIT" );
+      closeCtrl();
+    }
+  }
+
+private:
+  const Options &opt;
+  int id;
+  uint16_t port;
+  Results &res;
+  int ctrl;
+  std::string in;                 // bytes received on the control connection, not yet used
+  std::string ownFile;
+  std::string payload;
+  std::mt19937 rng;
+#ifdef FTP_LOAD_TLS
+  SSL *ctrlSsl;                   // TLS of the control connection after AUTH TLS
+
+  // Client handshake on fd, resuming session if not NULL; its time goes
+  // to times
+  //
+  //  return:
+  //    the connection, or NULL if the handshake failed
+  SSL *startTls( int fd, SSL_SESSION *session, std::vector<uint32_t> &times ){
+    struct timeval tv = { opt.timeout / 1000, ( opt.timeout % 1000 ) * 1000 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    SSL *ssl = SSL_new( sslCtx );
+    SSL_set_fd( ssl, fd );
+    if( session != NULL )
+      SSL_set_session( ssl, session );
+    uint64_t begin = nowUs();
+    if( SSL_connect( ssl ) != 1 ){
+      ERR_clear_error();
+      SSL_free( ssl );
+      return NULL;
+    }
+    times.push_back( (uint32_t)( nowUs() - begin ));
+    return ssl;
+  }
+#endif
+
+  void closeCtrl(){
+#ifdef FTP_LOAD_TLS
+    if( ctrlSsl != NULL )
+      SSL_free( ctrlSsl );
+    ctrlSsl = NULL;
+#endif
+    if( ctrl >= 0 )
+      close( ctrl );
+    ctrl = -1;
+    in.clear();
+  }
+
+  bool ctrlSend( const std::string &s ){
+#ifdef FTP_LOAD_TLS
+    if( ctrlSsl != NULL )
+      return SSL_write( ctrlSsl, s.data(), s.size() ) == (int) s.size();
+#endif
+    return ::send( ctrl, s.data(), s.size(), MSG_NOSIGNAL ) == (ssize_t) s.size();
+  }
+
+  // Bytes of the control connection, waiting for them up to the timeout
+  int ctrlRecv( char *b, int len ){
+#ifdef FTP_LOAD_TLS
+    if( ctrlSsl != NULL && SSL_pending( ctrlSsl ) > 0 )
+      return SSL_read( ctrlSsl, b, len );
+#endif
+    struct pollfd p = { ctrl, POLLIN, 0 };
+    if( poll( &p, 1, opt.timeout ) <= 0 )
+      return -1;
+#ifdef FTP_LOAD_TLS
+    if( ctrlSsl != NULL )
+      return SSL_read( ctrlSsl, b, len );
+#endif
+    return recv( ctrl, b, len, 0 );
+  }
+
+  // Read one reply, multi-line replies as a whole
+  //
+  //  return:
+  //    reply code, -1 if the connection is closed or timed out
+  int reply( std::string *text = NULL ){
+    for(;;){
+      size_t eol = in.find( '\n' );
+      if( eol == std::string::npos ){
+        char b[ 512 ];
+        int r = ctrlRecv( b, sizeof(b) );
+        if( r <= 0 )
+          return -1;
+        in.append( b, r );
+        continue;
+      }
+      std::string line = in.substr( 0, eol );
+      in.erase( 0, eol + 1 );
+      if( ! line.empty() && line[ line.size() - 1 ] == '\r' )
+        line.erase( line.size() - 1 );
+      if( line.size() < 3 || ! isdigit( line[0] ) || ! isdigit( line[1] ) || ! isdigit( line[2] ))
+        continue;   // text of a multi-line reply
+      int c = atoi( line.substr( 0, 3 ).c_str() );
+      if( line.size() == 3 || line[3] == ' ' ){
+        if( text != NULL )
+          *text = line;
+        return c;
+      }
+    }
+  }
+
+  // Send a command and read its reply, counting the latency
+  int command( const std::string &line, std::string *text = NULL ){
+    uint64_t begin = nowUs();
+    if( ! ctrlSend( line + "\r\n" ))
+      return -1;
+    int code = reply( text );
+    if( code > 0 )
+      res.cmd.push_back( (uint32_t)( nowUs() - begin ));
+    return code;
+  }
+
+  bool login(){
+    struct addrinfo hints, *ai;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[ 8 ];
+    snprintf( service, sizeof(service), "%u", port );
+    if( getaddrinfo( opt.host.c_str(), service, &hints, &ai ) != 0 )
+      return false;
+    ctrl = tcpConnect( (struct sockaddr_in*) ai->ai_addr, opt.timeout );
+    freeaddrinfo( ai );
+    if( ctrl < 0 )
+      return false;
+
+    int code = reply();
+    if( code != 220 ){
+      closeCtrl();
+      return false;
+    }
+#ifdef FTP_LOAD_TLS
+    if( opt.tls ){
+      if( command( "AUTH TLS" ) != 234
+        || ( ctrlSsl = startTls( ctrl, NULL, res.ctrlTls )) == NULL
+        || command( "PBSZ 0" ) != 200 || command( "PROT P" ) != 200 ){
+        closeCtrl();
+        return false;
+      }
+    }
+#endif
+    code = command( "USER " + opt.user );
+    if( code == 331 )
+      code = command( "PASS " + opt.pass );
+    if( code != 230 ){
+      closeCtrl();
+      return false;
+    }
+    if( command( "TYPE I" ) < 0 ){
+      closeCtrl();
+      return false;
+    }
+    return true;
+  }
+
+  // Listen for the data connection of the server, and give its address
+  // with PORT
+  //
+  //  return:
+  //    listening socket, or -1 with *code set as by openData()
+  int listenData( int *code ){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    // the address of the control connection is the one the server accepts
+    int fd = getsockname( ctrl, (struct sockaddr*) &addr, &len ) == 0 ? socket( AF_INET, SOCK_STREAM, 0 ) : -1;
+    addr.sin_port = 0;
+    len = sizeof(addr);
+    if( fd < 0 || bind( fd, (struct sockaddr*) &addr, sizeof(addr) ) < 0 || listen( fd, 1 ) < 0
+      || getsockname( fd, (struct sockaddr*) &addr, &len ) < 0 ){
+      if( fd >= 0 )
+        close( fd );
+      *code = 425;
+      return -1;
+    }
+    uint32_t ip = ntohl( addr.sin_addr.s_addr );
+    uint16_t port = ntohs( addr.sin_port );
+    char line[ 64 ];
+    snprintf( line, sizeof(line), "PORT %u,%u,%u,%u,%u,%u",
+      ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255, port >> 8, port & 255 );
+    *code = command( line );
+    if( *code != 200 ){
+      close( fd );
+      return -1;
+    }
+    return fd;
+  }
+
+  // Open a data connection for the next transfer command (in active mode,
+  // the socket it will come to)
+  //
+  //  return:
+  //    socket, or -1 with *code set to the reply (-1 if the session is lost)
+  int openData( int *code ){
+    if( opt.active )
+      return listenData( code );
+
+    std::string text;
+    *code = command( "PASV", &text );
+    if( *code != 227 )
+      return -1;
+    unsigned int h[ 6 ];
+    size_t p = text.find( '(' );
+    if( p == std::string::npos
+      || sscanf( text.c_str() + p + 1, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5] ) != 6 ){
+      *code = 500;
+      return -1;
+    }
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3] );
+    addr.sin_port = htons( h[4] << 8 | h[5] );
+    int fd = tcpConnect( &addr, opt.timeout );
+    if( fd < 0 )
+      *code = 425;
+    return fd;
+  }
+
+  // Run a transfer command over a new data connection, sending or
+  // receiving its data
+  //
+  //  return:
+  //    final reply code, -1 if the session is lost
+  int transfer( const std::string &line, const std::string *upload ){
+    int code;
+    int fd = openData( &code );
+    if( fd < 0 )
+      return code;
+
+    uint64_t begin = nowUs();
+    if( ! ctrlSend( line + "\r\n" )){
+      close( fd );
+      return -1;
+    }
+    code = reply();
+    if( code != 150 && code != 125 ){
+      close( fd );
+      if( code > 0 )
+        res.cmd.push_back( (uint32_t)( nowUs() - begin ));
+      return code;
+    }
+    res.dataConnect.push_back( (uint32_t)( nowUs() - begin ));
+
+    if( opt.active ){
+      // the server has connected by now, or does it right after PORT
+      int conn = -1;
+      struct pollfd p = { fd, POLLIN, 0 };
+      if( poll( &p, 1, opt.timeout ) > 0 )
+        conn = accept( fd, NULL, NULL );
+      close( fd );
+      if( conn < 0 )
+        return reply();
+      fd = conn;
+    }
+
+#ifdef FTP_LOAD_TLS
+    SSL *ssl = NULL;
+    if( opt.tls ){
+      SSL_SESSION *session = opt.resume ? SSL_get1_session( ctrlSsl ) : NULL;
+      ssl = startTls( fd, session, res.dataTls );
+      if( session != NULL )
+        SSL_SESSION_free( session );
+      if( ssl == NULL ){
+        close( fd );
+        return reply();
+      }
+      if( SSL_session_reused( ssl ))
+        res.resumed++;
+    }
+#endif
+    if( upload != NULL ){
+      size_t sent = 0;
+      while( sent < upload->size() ){
+        ssize_t r;
+#ifdef FTP_LOAD_TLS
+        if( ssl != NULL )
+          r = SSL_write( ssl, upload->data() + sent, upload->size() - sent );
+        else
+#endif
+        r = ::send( fd, upload->data() + sent, upload->size() - sent, MSG_NOSIGNAL );
+        if( r <= 0 )
+          break;
+        sent += r;
+      }
+      res.bytes += sent;
+#ifdef FTP_LOAD_TLS
+      if( ssl != NULL )
+        SSL_shutdown( ssl );
+#endif
+      shutdown( fd, SHUT_WR );
+    }
+    char b[ 4096 ];
+    for(;;){
+      ssize_t r;
+#ifdef FTP_LOAD_TLS
+      if( ssl != NULL ){
+        // up to the close_notify of the server
+        r = SSL_read( ssl, b, sizeof(b) );
+      }else
+#endif
+      {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if( poll( &p, 1, opt.timeout ) <= 0 )
+          break;
+        r = recv( fd, b, sizeof(b), 0 );
+      }
+      if( r <= 0 )
+        break;
+      if( upload == NULL )
+        res.bytes += r;
+    }
+#ifdef FTP_LOAD_TLS
+    if( ssl != NULL ){
+      if( upload == NULL )
+        SSL_shutdown( ssl );
+      ERR_clear_error();
+      SSL_free( ssl );
+    }
+#endif
+    close( fd );
+
+    code = reply();
+    if( code > 0 )
+      res.cmd.push_back( (uint32_t)( nowUs() - begin ));
+    return code;
+  }
+
+  int runOp( int op ){
+    const std::string &file = opt.file.empty() ? ownFile : opt.file;
+    switch( op ){
+      case OP_LIST:
+        return transfer( "LIST", NULL );
+      case OP_SIZE:
+        return command( "SIZE " + file );
+      case OP_RETR:
+        return transfer( "RETR " + file, NULL );
+      case OP_STOR:
+        return transfer( "STOR " + ownFile, &payload );
+      default:
+        return command( "DELE " + ownFile );
+    }
+  }
+};
+
+static uint32_t percentile( std::vector<uint32_t> &v, uint32_t permille ){
+  if( v.empty() )
+    return 0;
+  std::sort( v.begin(), v.end() );
+  size_t rank = ( v.size() * permille + 999 ) / 1000;
+  if( rank > 0 )
+    rank--;
+  return v[ std::min( rank, v.size() - 1 ) ];
+}
+
+static void usage(){
+  fprintf( stderr, "usage: ftp_load [-p port[,port...]] [-u user] [-w pass] [-c sessions] [-n count]\n"
+    "                [-m list=1,size=2,retr=4,stor=2,dele=1] [-s bytes] [-f path] [-t ms] [-a] [-T [-R]] host\n" );
+  exit( 2 );
+}
+
+static void parseMix( Options &opt, const char *mix ){
+  for( int i = 0; i < OP_COUNT; i++ )
+    opt.weights[ i ] = 0;
+  std::string s( mix );
+  size_t p = 0;
+  while( p < s.size() ){
+    size_t end = s.find( ',', p );
+    if( end == std::string::npos )
+      end = s.size();
+    std::string item = s.substr( p, end - p );
+    size_t eq = item.find( '=' );
+    int i = 0;
+    while( i < OP_COUNT && item.substr( 0, eq ) != opNames[ i ] )
+      i++;
+    if( i == OP_COUNT || eq == std::string::npos )
+      usage();
+    opt.weights[ i ] = atoi( item.c_str() + eq + 1 );
+    p = end + 1;
+  }
+  int total = 0;
+  for( int i = 0; i < OP_COUNT; i++ )
+    total += opt.weights[ i ];
+  if( total <= 0 )
+    usage();
+}
+
+int main( int argc, char **argv ){
+  Options opt;
+  int c;
+  while(( c = getopt( argc, argv, "p:u:w:c:n:m:s:f:t:aTR" )) != -1 ){
+    switch( c ){
+      case 'p':
+        for( char *t = strtok( optarg, "," ); t != NULL; t = strtok( NULL, "," ))
+          opt.ports.push_back( (uint16_t) atoi( t ));
+        break;
+      case 'u': opt.user = optarg; break;
+      case 'w': opt.pass = optarg; break;
+      case 'c': opt.sessions = atoi( optarg ); break;
+      case 'n': opt.count = atoi( optarg ); break;
+      case 'm': parseMix( opt, optarg ); break;
+      case 's': opt.storSize = strtoul( optarg, NULL, 10 ); break;
+      case 'f': opt.file = optarg; break;
+      case 't': opt.timeout = atoi( optarg ); break;
+      case 'a': opt.active = true; break;
+      case 'T': opt.tls = true; break;
+      case 'R': opt.resume = false; break;
+      default: usage();
+    }
+  }
+#ifdef FTP_LOAD_TLS
+  if( opt.tls ){
+    sslCtx = SSL_CTX_new( TLS_client_method() );
+    SSL_CTX_set_verify( sslCtx, SSL_VERIFY_NONE, NULL );
+    SSL_CTX_set_session_cache_mode( sslCtx, SSL_SESS_CACHE_CLIENT );
+  }
+#else
+  if( opt.tls ){
+    fprintf( stderr, "ftp_load: -T needs a build with -DFTP_LOAD_TLS\n" );
+    return 2;
+  }
+#endif
+  if( optind != argc - 1 || opt.sessions <= 0 )
+    usage();
+  opt.host = argv[ optind ];
+  if( opt.ports.empty() )
+    opt.ports.push_back( 21 );
+  signal( SIGPIPE, SIG_IGN );
+
+  std::vector<Results> results( opt.sessions );
+  std::vector<std::thread> threads;
+  uint64_t begin = nowUs();
+  for( int i = 0; i < opt.sessions; i++ ){
+    threads.push_back( std::thread( [ &opt, &results, i ](){
+      Session s( opt, i, opt.ports[ i % opt.ports.size() ], results[ i ] );
+      s.run();
+    }));
+  }
+  for( size_t i = 0; i < threads.size(); i++ )
+    threads[ i ].join();
+  double seconds = ( nowUs() - begin ) / 1e6;
+
+  Results all;
+  for( size_t i = 0; i < results.size(); i++ )
+    all.add( results[ i ] );
+  size_t ops = 0, failed = 0;
+  for( int i = 0; i < OP_COUNT; i++ ){
+    ops += all.op[ i ].size() + all.failed[ i ];
+    failed += all.failed[ i ];
+  }
+  uint64_t dataConnectSum = 0;
+  for( size_t i = 0; i < all.dataConnect.size(); i++ )
+    dataConnectSum += all.dataConnect[ i ];
+
+  printf( "{\"sessions\":%d,\"seconds\":%.3f,\"ops\":%zu,\"failed\":%zu,\"refused\":%u,\"dropped\":%u,"
+    "\"opsPerSec\":%.1f,\"bytesPerSec\":%.0f,\"commands\":%zu,\"cmdP50us\":%u,\"cmdP99us\":%u,\"cmdP999us\":%u,"
+    "\"dataConnects\":%zu,\"dataConnectMeanUs\":%llu,\"dataConnectP50us\":%u,\"dataConnectP99us\":%u",
+    opt.sessions, seconds, ops, failed, all.refused, all.dropped,
+    ops / seconds, all.bytes / seconds, all.cmd.size(),
+    percentile( all.cmd, 500 ), percentile( all.cmd, 990 ), percentile( all.cmd, 999 ),
+    all.dataConnect.size(), (unsigned long long)( all.dataConnect.empty() ? 0 : dataConnectSum / all.dataConnect.size() ),
+    percentile( all.dataConnect, 500 ), percentile( all.dataConnect, 990 ));
+  for( int i = 0; i < OP_COUNT; i++ ){
+    printf( ",\"%s\":{\"ok\":%zu,\"failed\":%u,\"p50us\":%u,\"p99us\":%u,\"p999us\":%u}",
+      opNames[ i ], all.op[ i ].size(), all.failed[ i ],
+      percentile( all.op[ i ], 500 ), percentile( all.op[ i ], 990 ), percentile( all.op[ i ], 999 ));
+  }
+  if( opt.tls ){
+    printf( ",\"ctrlTls\":{\"count\":%zu,\"p50us\":%u,\"p99us\":%u},\"dataTls\":{\"count\":%zu,\"resumed\":%u,\"p50us\":%u,\"p99us\":%u}",
+      all.ctrlTls.size(), percentile( all.ctrlTls, 500 ), percentile( all.ctrlTls, 990 ),
+      all.dataTls.size(), all.resumed, percentile( all.dataTls, 500 ), percentile( all.dataTls, 990 ));
+  }
+  printf( "}\n" );
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Make a self-signed EC certificate and its key for setCertificate(), as
+# C string literals to include in a sketch. For tests only: clients have to
+# be told not to verify the certificate (e.g. lftp "set ssl:verify-certificate
+# no", curl -k).
+#
+# Usage:
+#   tools/gen_test_cert.sh [common name] > src/ftp_cert.h
+#
+
+cn=${1:-esp32-ftp}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+  -keyout "$dir/key.pem" -out "$dir/cert.pem" -days 3650 -subj "/CN=$cn" \
+  2>/dev/null || { echo "openssl failed" >&2; exit 1; }
+
+literal(){
+  sed -e 's/^/  "/' -e 's/$/\\n"/' "$1"
+}
+
+echo "// Test certificate for CN=$cn, made by tools/gen_test_cert.sh"
+echo "static const char ftp_cert_pem[] ="
+literal "$dir/cert.pem"
+echo "  ;"
+echo "static const char ftp_key_pem[] ="
+literal "$dir/key.pem"
+echo "  ;"
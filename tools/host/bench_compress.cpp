@@ -0,0 +1,122 @@
+/*
+ * Benchmark of the compression of the stored file
+ *
+ * For three kinds of contents (CSV text, random bytes, zeros):
+ *   - ratio and speed of the codec on blocks of FTP_BUF_SIZE bytes
+ *   - STOR and RETR throughput of the server, with and without
+ *     setCompression()
+ *   - readFile() throughput in reads of 100 bytes, which take parts of the
+ *     blocks
+ *
+ * Usage:
+ *   bench_compress [size in bytes (1 MB)]
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+#include "FtpLz.h"
+
+#include <chrono>
+
+static double now(){
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static std::string contents( int kind, size_t size ){
+  std::string s;
+  if( kind == 0 ){
+    // log of a sensor, as a data logger stores it
+    char line[ 80 ];
+    for( unsigned long i = 0; s.size() < size; i++ ){
+      snprintf( line, sizeof(line), "2026-10-18 12:%02lu:%02lu,%lu,%.2f,%.1f,OK\n", i / 60 % 60, i % 60, i,
+        20 + ( i * 37 % 100 ) / 10.0, 1000 + ( i * 13 % 50 ) / 10.0 );
+      s += line;
+    }
+    s.resize( size );
+  }else
+  if( kind == 1 ){
+    uint32_t x = 12345;
+    for( size_t i = 0; i < size; i++ ){
+      x = x * 1103515245 + 12345;
+      s += (char)( x >> 23 );
+    }
+  }else{
+    s.assign( size, '\0' );
+  }
+  return s;
+}
+
+int main( int argc, char **argv ){
+  size_t size = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1 << 20;
+  static unsigned char buffer[ 4 << 20 ];
+  if( size == 0 || size > sizeof(buffer) / 2 )
+    size = 1 << 20;
+  static FtpServer srv( 2181, 2182 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+  HostLoop loop( srv );
+  FtpClient ftp( 2181 );
+  if( ! ftp.login( "user", "pass" )){
+    fprintf( stderr, "bench_compress: login failed\n" );
+    return 1;
+  }
+
+  const char *names[] = { "csv", "random", "zeros" };
+  printf( "contents  ratio  lz MB/s  unlz MB/s  STOR MB/s  RETR MB/s  STOR z MB/s  RETR z MB/s  readFile z MB/s\n" );
+  for( int kind = 0; kind < 3; kind++ ){
+    std::string data = contents( kind, size );
+
+    // the codec alone
+    std::vector<unsigned char> blocks( size + size / FTP_BUF_SIZE * 4 + 4 );
+    std::vector<unsigned int> lengths;
+    size_t stored = 0;
+    double begin = now();
+    for( size_t i = 0; i < size; i += FTP_BUF_SIZE ){
+      unsigned int n = std::min( (size_t) FTP_BUF_SIZE, size - i );
+      unsigned int z = lzCompress( (const uint8_t*) data.data() + i, n, &blocks[ stored ], n - 1 );
+      lengths.push_back( z );
+      stored += z > 0 ? z : n;
+    }
+    double lz = size / ( now() - begin ) / 1e6;
+    unsigned char back[ FTP_BUF_SIZE ];
+    size_t at = 0, unpacked = 0;
+    begin = now();
+    for( size_t i = 0, b = 0; i < size; i += FTP_BUF_SIZE, b++ ){
+      unsigned int n = std::min( (size_t) FTP_BUF_SIZE, size - i );
+      if( lengths[ b ] > 0 )
+        unpacked += lzDecompress( &blocks[ at ], lengths[ b ], back, n );
+      at += lengths[ b ] > 0 ? lengths[ b ] : n;
+    }
+    // 0 if no block could be compressed
+    double unlz = unpacked / ( now() - begin ) / 1e6;
+    stored += 4 * lengths.size();
+
+    double rates[ 4 ];
+    for( int z = 0; z < 2; z++ ){
+      srv.setCompression( z == 1 );
+      begin = now();
+      int stor = ftp.stor( "/bench.bin", data );
+      rates[ 2 * z ] = size / ( now() - begin ) / 1e6;
+      std::string got;
+      begin = now();
+      int retr = ftp.retr( "/bench.bin", &got );
+      rates[ 2 * z + 1 ] = size / ( now() - begin ) / 1e6;
+      if( stor != 226 || retr != 226 || got != data ){
+        fprintf( stderr, "bench_compress: %s transfer failed\n", names[ kind ] );
+        return 1;
+      }
+    }
+
+    // the stored file is compressed now
+    unsigned char part[ 100 ];
+    begin = now();
+    for( unsigned long at = 0; at < size; at += sizeof(part) )
+      srv.readFile( at, part, sizeof(part) );
+    double reads = size / ( now() - begin ) / 1e6;
+
+    printf( "%-8s  %5.2f  %7.0f  %9.0f  %9.1f  %9.1f  %11.1f  %11.1f  %15.0f\n", names[ kind ], (double) size / stored,
+      lz, unlz, rates[0], rates[1], rates[2], rates[3], reads );
+  }
+  ftp.command( "QUIT" );
+  loop.stop();
+  return 0;
+}
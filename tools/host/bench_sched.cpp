@@ -0,0 +1,222 @@
+/*
+ * Benchmark of the scheduling of the control connection: what running the
+ * session as the FTP_C_STATUS switch costs, against running it as a C++20
+ * coroutine
+ *
+ *   server     CPU of the server thread per NOOP round trip, waitFTP() and
+ *              handleFTP() included, for the scale of the numbers below
+ *   switch     a session modelled as handleStep() runs it: a status and a
+ *              switch on it for every command line
+ *   coroutine  the same session written as a coroutine, which co_awaits the
+ *              next command line; its frame is taken from a fixed pool, as
+ *              the sketch could not allocate it from the heap
+ *
+ * Both models parse the same lines (USER, PASS, some NOOP, QUIT) and count
+ * the same replies. The coroutine model needs -std=c++20 (built so by
+ * build.sh); the espressif32 toolchain builds the sketch as C++11 with GCC 8,
+ * which has no coroutines.
+ *
+ * Usage:
+ *   bench_sched [sessions (200000)]
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#include <chrono>
+#include <coroutine>
+#include <pthread.h>
+#include <time.h>
+
+#define COMMANDS 8                    // NOOP in a session of the models
+
+static double now(){
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// CPU time used by thread, in s
+static double threadCpu( std::thread &thread ){
+  clockid_t clock;
+  struct timespec t;
+  if( pthread_getcpuclockid( thread.native_handle(), &clock ) != 0 || clock_gettime( clock, &t ) != 0 )
+    return 0;
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Replies of the models, read at the end so that nothing is optimized away
+static unsigned long replies[ 4 ];
+
+static void reply( int code ){
+  replies[ code ]++;
+}
+
+////////////////////////////////////////////////
+// The switch, as handleStep() dispatches
+////////////////////////////////////////////////
+
+struct SwitchSession {
+  FTP_C_STATUS status = C_USER;
+
+  void line( const char *cmd ){
+    switch( status ){
+      case C_USER:
+        if( ! strcmp( cmd, "USER" )){
+          reply( 0 );
+          status = C_PASS;
+        }else
+          status = C_DISCONNECT;
+        break;
+      case C_PASS:
+        if( ! strcmp( cmd, "PASS" )){
+          reply( 1 );
+          status = C_COMMAND;
+        }else
+          status = C_DISCONNECT;
+        break;
+      case C_COMMAND:
+        if( ! strcmp( cmd, "QUIT" )){
+          reply( 3 );
+          status = C_DISCONNECT;
+        }else
+          reply( 2 );
+        break;
+      default:
+        break;
+    }
+  }
+};
+
+////////////////////////////////////////////////
+// The coroutine
+////////////////////////////////////////////////
+
+// Fixed pool of frames: a single one, a session at a time like an instance
+static unsigned char framePool[ 1024 ];
+static size_t frameSize;
+static bool frameUsed;
+
+struct CoSession {
+  struct promise_type {
+    const char *cmd = NULL;
+
+    static void *operator new( size_t size ){
+      frameSize = size;
+      if( frameUsed || size > sizeof(framePool) )
+        abort();
+      frameUsed = true;
+      return framePool;
+    }
+    static void operator delete( void * ){
+      frameUsed = false;
+    }
+    CoSession get_return_object(){
+      return CoSession( std::coroutine_handle<promise_type>::from_promise( *this ));
+    }
+    // run to the first co_await at once
+    std::suspend_never initial_suspend(){ return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void(){}
+    void unhandled_exception(){ abort(); }
+  };
+
+  // co_await next: suspend until line() gives the next command
+  struct Next {
+    promise_type *promise;
+    bool await_ready(){ return false; }
+    void await_suspend( std::coroutine_handle<promise_type> h ){ promise = &h.promise(); }
+    const char *await_resume(){ return promise->cmd; }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+
+  explicit CoSession( std::coroutine_handle<promise_type> h ) : handle( h ){}
+  ~CoSession(){
+    handle.destroy();
+  }
+  void line( const char *cmd ){
+    if( ! handle.done() ){
+      handle.promise().cmd = cmd;
+      handle.resume();
+    }
+  }
+};
+
+static CoSession session(){
+  const char *cmd = co_await CoSession::Next();
+  if( strcmp( cmd, "USER" ))
+    co_return;
+  reply( 0 );
+  cmd = co_await CoSession::Next();
+  if( strcmp( cmd, "PASS" ))
+    co_return;
+  reply( 1 );
+  while( strcmp( cmd = co_await CoSession::Next(), "QUIT" ))
+    reply( 2 );
+  reply( 3 );
+}
+
+////////////////////////////////////////////////
+
+static const char *lines[ COMMANDS + 3 ];
+
+// ns per command line of n sessions of the model
+template<class S, class F> static double model( unsigned long n, F start ){
+  double begin = now();
+  for( unsigned long i = 0; i < n; i++ ){
+    S s = start();
+    for( int l = 0; l < COMMANDS + 3; l++ )
+      s.line( lines[ l ] );
+  }
+  return ( now() - begin ) * 1e9 / ( n * ( COMMANDS + 3 ));
+}
+
+int main( int argc, char **argv ){
+  unsigned long n = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 200000;
+  if( n == 0 )
+    n = 200000;
+
+  // the real server
+  static unsigned char buffer[ 4096 ];
+  static FtpServer srv( 2201, 2202 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+  std::atomic<bool> quit( false );
+  std::thread loop( [ & ](){
+    while( ! quit ){
+      srv.waitFTP( 1000 );
+      srv.handleFTP( 10000 );
+    }
+  });
+  FtpClient *ftp = new FtpClient( 2201 );
+  ftp->login( "user", "pass" );
+  double cpu = threadCpu( loop );
+  for( int i = 0; i < 5000; i++ )
+    ftp->command( "NOOP" );
+  cpu = ( threadCpu( loop ) - cpu ) * 1e9 / 5000;
+  ftp->command( "QUIT" );
+  delete ftp;
+  quit = true;
+  loop.join();
+
+  lines[ 0 ] = "USER";
+  lines[ 1 ] = "PASS";
+  for( int l = 0; l < COMMANDS; l++ )
+    lines[ 2 + l ] = "NOOP";
+  lines[ COMMANDS + 2 ] = "QUIT";
+
+  // twice each, the first as a warm up
+  double sw = 0, co = 0;
+  for( int pass = 0; pass < 2; pass++ ){
+    sw = model<SwitchSession>( n, [](){ return SwitchSession(); });
+    co = model<CoSession>( n, [](){ return session(); });
+  }
+  unsigned long expected = 4 * n * ( 1 + 1 + COMMANDS + 1 );
+  if( replies[0] + replies[1] + replies[2] + replies[3] != expected ){
+    fprintf( stderr, "bench_sched: the models replied differently\n" );
+    return 1;
+  }
+
+  printf( "server    %8.0f ns CPU per NOOP\n", cpu );
+  printf( "switch    %8.2f ns per line  %4zu bytes of state\n", sw, sizeof(SwitchSession) );
+  printf( "coroutine %8.2f ns per line  %4zu bytes of frame\n", co, frameSize );
+  return 0;
+}
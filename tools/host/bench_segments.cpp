@@ -0,0 +1,88 @@
+/*
+ * Benchmark of segmented downloads: throughput against the number of
+ * segments
+ *
+ * A server instance serves a single session, so a client fetching n
+ * segments of a file at once talks to n instances, which serve the same
+ * read-only bytes (addReadOnlyFile() on each, no copy). Each segment is a
+ * REST and a RETR closed after its length, as segmented clients do.
+ * Without a limit the loopback and the polling of the instances bound the
+ * throughput; with a session limit it grows with the segments.
+ *
+ * Usage:
+ *   bench_segments [max segments (8)]
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#include <chrono>
+
+#define MAX_SEGMENTS 8
+
+static unsigned char contents[ 4 << 20 ];
+
+static double now(){
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void segment( int i, unsigned long offset, unsigned long length, std::string *out ){
+  FtpClient ftp( 2171 + 2 * i );
+  if( ftp.login( "user", "pass" ))
+    ftp.receive( "RETR /data.bin", out, length, offset );
+}
+
+// Fetch size bytes of the file in n segments
+//
+//  return:
+//    bytes/s, 0 if the bytes got are not those of the file
+static double fetch( int n, unsigned long size ){
+  std::vector<std::string> parts( n );
+  std::vector<std::thread> clients;
+  double begin = now();
+  for( int i = 0; i < n; i++ ){
+    unsigned long offset = size * i / n;
+    clients.push_back( std::thread( segment, i, offset, size * ( i + 1 ) / n - offset, &parts[i] ));
+  }
+  for( int i = 0; i < n; i++ )
+    clients[i].join();
+  double elapsed = now() - begin;
+  std::string all;
+  for( int i = 0; i < n; i++ )
+    all += parts[i];
+  if( all.size() != size || memcmp( all.data(), contents, size ) != 0 )
+    return 0;
+  return size / elapsed;
+}
+
+int main( int argc, char **argv ){
+  int max = argc > 1 ? atoi( argv[1] ) : MAX_SEGMENTS;
+  if( max < 1 || max > MAX_SEGMENTS )
+    max = MAX_SEGMENTS;
+  for( unsigned long i = 0; i < sizeof(contents); i++ )
+    contents[i] = i * 31 + ( i >> 11 );
+
+  static unsigned char buffers[ MAX_SEGMENTS ][ 1024 ];
+  std::vector<FtpServer*> servers;
+  for( int i = 0; i < max; i++ ){
+    FtpServer *srv = new FtpServer( 2171 + 2 * i, 2172 + 2 * i );
+    srv->begin( "user", "pass", buffers[i], sizeof(buffers[i]) );
+    srv->addReadOnlyFile( "data.bin", contents, sizeof(contents) );
+    servers.push_back( srv );
+  }
+  HostLoop loop( servers );
+
+  printf( "segments  unlimited MB/s  limited to 200 kB/s a session, kB/s\n" );
+  for( int n = 1; n <= max; n *= 2 ){
+    for( int i = 0; i < max; i++ )
+      servers[i]->setRateLimit( 0 );
+    double fast = fetch( n, sizeof(contents) );
+    for( int i = 0; i < max; i++ )
+      servers[i]->setRateLimit( 200000 );
+    double slow = fetch( n, 800000 );
+    printf( "%8d  %14.1f  %10.0f\n", n, fast / 1e6, slow / 1e3 );
+  }
+
+  loop.stop();
+  return 0;
+}
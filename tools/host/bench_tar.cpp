@@ -0,0 +1,104 @@
+/*
+ * Benchmark of the archive: fetching 100 files one RETR at a time against
+ * one RETR of their directory as a tar
+ *
+ * The files are read-only ones of 4 KB under /logs, so this is built with
+ * FTP_MAX_ROFILES=100 (bench_tar in build.sh). Each reply waits the round
+ * trip time given, to play a slower link than the loopback: the RETR of a
+ * file costs a PASV, a 150 and a 226, the archive costs them once. The
+ * members of the archive are checked against the files.
+ *
+ * Usage:
+ *   bench_tar [round trip time in ms (20)]
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#include <chrono>
+
+#define FILES 100
+#define FILE_SIZE 4096
+
+#if FTP_MAX_ROFILES < FILES
+#error bench_tar needs -DFTP_MAX_ROFILES=100
+#endif
+
+static unsigned char contents[ FILES ][ FILE_SIZE ];
+
+static double now(){
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Check the members of the archive against the files
+static bool checkTar( const std::string &tar ){
+  int found = 0;
+  for( size_t at = 0; at + 512 <= tar.size() && tar[ at ] != '\0'; ){
+    const char *header = tar.data() + at;
+    unsigned long size = strtoul( header + 124, NULL, 8 );
+    int i;
+    if( sscanf( header, "f%03d.csv", &i ) != 1 || i < 0 || i >= FILES || size != FILE_SIZE
+        || at + 512 + size > tar.size() || memcmp( header + 512, contents[i], size ) != 0 )
+      return false;
+    found++;
+    at += 512 + ( size + 511 ) / 512 * 512;
+  }
+  return found == FILES;
+}
+
+// Time of the two ways to fetch the files, in s, -1 if a transfer failed
+static void fetch( int rtt, double *single, double *archive ){
+  FtpClient ftp( 2221 );
+  ftp.login( "user", "pass" );
+  ftp.setRtt( rtt );
+
+  std::string got;
+  double begin = now();
+  for( int i = 0; i < FILES && *single >= 0; i++ ){
+    char path[ 32 ];
+    snprintf( path, sizeof(path), "/logs/f%03d.csv", i );
+    got.clear();
+    if( ftp.retr( path, &got ) != 226 || got.size() != FILE_SIZE || memcmp( got.data(), contents[i], FILE_SIZE ) != 0 )
+      *single = -1;
+  }
+  if( *single >= 0 )
+    *single = now() - begin;
+
+  got.clear();
+  begin = now();
+  if( ftp.retr( "/logs.tar", &got ) == 226 && checkTar( got ))
+    *archive = now() - begin;
+  else
+    *archive = -1;
+  ftp.setRtt( 0 );
+  ftp.command( "QUIT" );
+}
+
+int main( int argc, char **argv ){
+  int rtt = argc > 1 ? atoi( argv[1] ) : 20;
+  static unsigned char buffer[ 4096 ];
+  static FtpServer srv( 2221, 2222 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+  for( int i = 0; i < FILES; i++ ){
+    char name[ 32 ];
+    snprintf( name, sizeof(name), "logs/f%03d.csv", i );
+    for( int j = 0; j < FILE_SIZE; j++ )
+      contents[i][j] = "0123456789,\n"[ ( i + j * 7 ) % 12 ];
+    srv.addReadOnlyFile( name, contents[i], FILE_SIZE );
+  }
+  HostLoop loop( srv );
+
+  printf( "rtt ms  %d RETR ms  one tar ms  speedup\n", FILES );
+  int rtts[] = { 0, rtt };
+  for( int r = 0; r < ( rtt > 0 ? 2 : 1 ); r++ ){
+    double single = 0, archive = 0;
+    fetch( rtts[r], &single, &archive );
+    if( single < 0 || archive < 0 ){
+      fprintf( stderr, "bench_tar: transfer failed\n" );
+      return 1;
+    }
+    printf( "%6d  %12.1f  %10.1f  %7.1f\n", rtts[r], single * 1e3, archive * 1e3, single / archive );
+  }
+  loop.stop();
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Benchmark of the idle loop: CPU used while a session is idle or a
+ * transfer throttled (10 KB STOR and RETR at 4000 bytes/s), and the latency
+ * of waking up for a command and for a new connection
+ *
+ *   poll    handleFTP() called in a loop, as the Arduino loop() does
+ *   select  waitFTP() before each handleFTP(), which checks the listening
+ *           socket every FTP_WAIT_SLICE ms
+ *   epoll   the same built with FTP_WAIT_EPOLL (bench_wait_epoll), which
+ *           sleeps on the listening socket too
+ *
+ * Usage:
+ *   bench_wait       poll and select
+ *   bench_wait_epoll epoll
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#include <chrono>
+#include <pthread.h>
+#include <time.h>
+
+static uint32_t nowUs(){
+  return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// CPU time used by thread, in s
+static double threadCpu( std::thread &thread ){
+  clockid_t clock;
+  struct timespec t;
+  if( pthread_getcpuclockid( thread.native_handle(), &clock ) != 0 || clock_gettime( clock, &t ) != 0 )
+    return 0;
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void run( FtpServer &srv, const char *mode, bool wait ){
+  std::atomic<bool> quit( false );
+  std::thread loop( [ & ](){
+    while( ! quit ){
+      if( wait )
+        srv.waitFTP( 1000 );
+      srv.handleFTP( wait ? 10000 : 0 );
+    }
+  });
+
+  // CPU of an idle session
+  FtpClient *ftp = new FtpClient( 2191 );
+  ftp->login( "user", "pass" );
+  usleep( 100000 );
+  double cpu = threadCpu( loop );
+  usleep( 2000000 );
+  cpu = threadCpu( loop ) - cpu;
+  std::vector<uint32_t> noop;
+  for( int i = 0; i < 200; i++ ){
+    usleep( 2000 + i * 37 % 3000 );
+    uint32_t t = nowUs();
+    ftp->command( "NOOP" );
+    noop.push_back( nowUs() - t );
+  }
+  ftp->command( "QUIT" );
+  delete ftp;
+
+  // new connections
+  std::vector<uint32_t> accept;
+  for( int i = 0; i < 30; i++ ){
+    usleep( 5000 + i * 1013 % 20000 );
+    uint32_t t = nowUs();
+    FtpClient c( 2191 );
+    accept.push_back( nowUs() - t );
+    // QUIT before the login is answered by a delay against password guessing
+    c.login( "user", "pass" );
+    c.command( "QUIT" );
+  }
+
+  // throttled transfers
+  srv.setRateLimit( 4000 );
+  FtpClient c( 2191 );
+  c.login( "user", "pass" );
+  std::string data( 10240, 'x' ), got;
+  double throttled = threadCpu( loop );
+  uint32_t t = nowUs();
+  c.stor( "/t.bin", data );
+  c.retr( "/t.bin", &got );
+  throttled = ( threadCpu( loop ) - throttled ) / (( nowUs() - t ) / 1e6 );
+  c.command( "QUIT" );
+  srv.setRateLimit( 0 );
+
+  quit = true;
+  loop.join();
+  printf( "%-6s  %9.2f  %14.2f  %8u  %8u  %10u  %10u\n", mode, 100 * cpu / 2.0, 100 * throttled,
+    percentile( noop, 500 ), percentile( noop, 990 ), percentile( accept, 500 ), percentile( accept, 990 ));
+}
+
+int main(){
+  static unsigned char buffer[ 16384 ];
+  static FtpServer srv( 2191, 2192 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+
+  printf( "mode    idle CPU %%  throttled CPU %%  NOOP p50  NOOP p99  accept p50  accept p99 (us)\n" );
+#ifdef FTP_WAIT_EPOLL
+  run( srv, "epoll", true );
+#else
+  run( srv, "poll", false );
+  run( srv, "select", true );
+#endif
+  return 0;
+}
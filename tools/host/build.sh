@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Build the host harness of the FTP server: the server on loopback
+# stand-ins of WiFiClient/WiFiServer (ftp_host), the trace replayer
+# (ftp_replay), the load generator, the tests and the benchmarks.
+#
+# Usage:
+#   tools/host/build.sh [output directory]      (tools/host/build)
+#   tools/host/run_tests.sh [output directory]
+#   tools/host/size_report.sh [output directory]
+#
+# CXX and CXXFLAGS are taken from the environment.
+#
+
+here=$(cd "$(dirname "$0")" && pwd)
+src="$here/../../src"
+out=${1:-"$here/build"}
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-O2 -g"}
+mkdir -p "$out" || exit 1
+
+# build name flags... sources...
+build(){
+  name=$1
+  shift
+  echo "  $name"
+  $CXX -std=gnu++11 $CXXFLAGS -Wall -Wextra -pthread -I"$here/include" -I"$here" -I"$src" \
+    -o "$out/$name" "$@" "$src/ESP32FtpServer.cpp" "$src/FtpLz.cpp" "$here/host.cpp" || exit 1
+}
+
+echo "building into $out"
+build ftp_host -DFTP_TRACE -DFTP_STATS "$here/ftp_host.cpp"
+build ftp_replay -DFTP_TRACE "$here/ftp_replay.cpp"
+build test_rate "$here/test_rate.cpp"
+build test_alloc "$here/test_alloc.cpp"
+build test_snapshot "$here/test_snapshot.cpp"
+build bench_segments "$here/bench_segments.cpp"
+build bench_compress "$here/bench_compress.cpp"
+build bench_wait "$here/bench_wait.cpp"
+build bench_wait_epoll -DFTP_WAIT_EPOLL "$here/bench_wait.cpp"
+build bench_tar -DFTP_MAX_ROFILES=100 "$here/bench_tar.cpp"
+# the coroutine model needs C++20, the last -std given wins
+build bench_sched -std=gnu++20 "$here/bench_sched.cpp"
+echo "  ftp_load"
+$CXX -std=c++11 $CXXFLAGS -pthread -o "$out/ftp_load" "$here/../ftp_load.cpp" || exit 1
@@ -0,0 +1,225 @@
+/*
+ * Minimal blocking FTP client of the host tests and benchmarks
+ *
+ * Passive mode, plain connections. Every wait is bounded by the timeout
+ * given to the constructor, so that a server which stops answering fails
+ * the test instead of hanging it.
+ */
+
+#ifndef FTP_CLIENT_H
+#define FTP_CLIENT_H
+
+#include <string>
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class FtpClient{
+public:
+  explicit FtpClient( uint16_t port, int timeout = 10000 ) : timeout( timeout ), rtt( 0 ){
+    ctrl = connectTo( htonl( INADDR_LOOPBACK ), port );
+    if( ctrl >= 0 && reply() != 220 )
+      closeCtrl();
+  }
+  ~FtpClient(){ closeCtrl(); }
+
+  bool connected() const { return ctrl >= 0; }
+
+  // Add ms to every reply wait, to play a link with that round trip time
+  void setRtt( int ms ){ rtt = ms; }
+
+  // Text of the last final reply
+  const std::string &text() const { return last; }
+
+  // Read one reply, multi-line replies as a whole
+  //
+  //  return:
+  //    reply code, -1 if the connection is closed or timed out
+  int reply(){
+    if( rtt > 0 )
+      usleep( rtt * 1000 );
+    for(;;){
+      size_t eol = in.find( '\n' );
+      if( eol == std::string::npos ){
+        char b[ 512 ];
+        struct pollfd p = { ctrl, POLLIN, 0 };
+        int r = ctrl >= 0 && poll( &p, 1, timeout ) > 0 ? recv( ctrl, b, sizeof(b), 0 ) : -1;
+        if( r <= 0 )
+          return -1;
+        in.append( b, r );
+        continue;
+      }
+      std::string line = in.substr( 0, eol );
+      in.erase( 0, eol + 1 );
+      if( ! line.empty() && line[ line.size() - 1 ] == '\r' )
+        line.erase( line.size() - 1 );
+      if( line.size() < 3 || ! isdigit( line[0] ) || ! isdigit( line[1] ) || ! isdigit( line[2] ))
+        continue;
+      if( line.size() == 3 || line[3] == ' ' ){
+        last = line;
+        return atoi( line.c_str() );
+      }
+    }
+  }
+
+  bool send( const char *line ){
+    std::string s( line );
+    s += "\r\n";
+    return ctrl >= 0 && ::send( ctrl, s.data(), s.size(), MSG_NOSIGNAL ) == (ssize_t) s.size();
+  }
+
+  // Send a command and read its reply
+  int command( const char *format, ... ) __attribute__ ((format (printf, 2, 3))){
+    char line[ 512 ];
+    va_list args;
+    va_start( args, format );
+    vsnprintf( line, sizeof(line), format, args );
+    va_end( args );
+    return send( line ) ? reply() : -1;
+  }
+
+  bool login( const char *user, const char *pass ){
+    int code = command( "USER %s", user );
+    if( code == 331 )
+      code = command( "PASS %s", pass );
+    return code == 230 && command( "TYPE I" ) == 200;
+  }
+
+  // PASV and connect to the port given
+  //
+  //  return:
+  //    data socket, -1 if failed
+  int openPasv(){
+    if( command( "PASV" ) != 227 )
+      return -1;
+    unsigned int h[ 6 ];
+    size_t p = last.find( '(' );
+    if( p == std::string::npos
+      || sscanf( last.c_str() + p + 1, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5] ) != 6 )
+      return -1;
+    return connectTo( htonl( h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3] ), h[4] << 8 | h[5] );
+  }
+
+  // Run a transfer command (RETR, LIST...), appending what it sends to out
+  // (if not NULL), at most limit bytes, after which the data connection is
+  // closed as segmented downloads do. With restart > 0, REST restart is sent
+  // before the command.
+  //
+  //  return:
+  //    final reply code, -1 if the session is lost
+  int receive( const char *line, std::string *out, size_t limit = (size_t) -1, unsigned long restart = 0 ){
+    int fd = openPasv();
+    if( fd < 0 )
+      return 425;
+    if( restart > 0 && command( "REST %lu", restart ) != 350 ){
+      close( fd );
+      return last.empty() ? -1 : atoi( last.c_str() );
+    }
+    if( ! send( line )){
+      close( fd );
+      return -1;
+    }
+    int code = reply();
+    if( code != 150 && code != 125 ){
+      close( fd );
+      return code;
+    }
+    char b[ 16384 ];
+    size_t got = 0;
+    while( got < limit ){
+      struct pollfd p = { fd, POLLIN, 0 };
+      int r = poll( &p, 1, timeout ) > 0 ? recv( fd, b, sizeof(b), 0 ) : -1;
+      if( r <= 0 )
+        break;
+      if( (size_t) r > limit - got )
+        r = limit - got;
+      if( out != NULL )
+        out->append( b, r );
+      got += r;
+    }
+    close( fd );
+    return reply();
+  }
+
+  // Run STOR (or APPE...) with data
+  int store( const char *line, const std::string &data ){
+    int fd = openPasv();
+    if( fd < 0 )
+      return 425;
+    if( ! send( line )){
+      close( fd );
+      return -1;
+    }
+    int code = reply();
+    if( code != 150 && code != 125 ){
+      close( fd );
+      return code;
+    }
+    size_t sent = 0;
+    while( sent < data.size() ){
+      ssize_t r = ::send( fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL );
+      if( r <= 0 )
+        break;
+      sent += r;
+    }
+    close( fd );
+    return reply();
+  }
+
+  int retr( const char *path, std::string *out ){
+    std::string line = std::string( "RETR " ) + path;
+    return receive( line.c_str(), out );
+  }
+
+  int stor( const char *path, const std::string &data ){
+    std::string line = std::string( "STOR " ) + path;
+    return store( line.c_str(), data );
+  }
+
+private:
+  int ctrl;
+  int timeout;
+  int rtt;
+  std::string in;                 // bytes received on the control connection, not yet used
+  std::string last;
+
+  // Connect to addr:port (network order address)
+  //
+  //  return:
+  //    socket, -1 if failed
+  static int connectTo( uint32_t addr, uint16_t port ){
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( fd < 0 )
+      return -1;
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    struct sockaddr_in a;
+    memset( &a, 0, sizeof(a) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = addr;
+    a.sin_port = htons( port );
+    if( connect( fd, (struct sockaddr*) &a, sizeof(a) ) < 0 ){
+      close( fd );
+      return -1;
+    }
+    return fd;
+  }
+
+  void closeCtrl(){
+    if( ctrl >= 0 )
+      close( ctrl );
+    ctrl = -1;
+  }
+};
+
+#endif // FTP_CLIENT_H
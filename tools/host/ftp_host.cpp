@@ -0,0 +1,165 @@
+/*
+ * The FTP server on the host, on loopback sockets
+ *
+ * For ftp_load, any FTP client, and recording traces to replay with
+ * ftp_replay. Built by build.sh.
+ *
+ * Usage:
+ *   ftp_host [options]
+ *     -p port      control port (2121), the passive data port is -d (50009)
+ *     -d port      passive data port
+ *     -u user -w pass
+ *                  login (anonymous, any password)
+ *     -b bytes     size of the file buffer (1 MB)
+ *     -r rate      session rate limit in bytes/s
+ *     -g rate      global rate limit in bytes/s
+ *     -z           compress the stored files
+ *     -s           give a snapshot buffer, for SITE SNAP
+ *     -o file      serve file as the read-only file /<name of file>
+ *     -t file      record the sessions into file (needs -DFTP_TRACE)
+ *     -T           offer AUTH TLS with the certificate of ftp_cert.h
+ *                  (needs -DFTP_ENABLE_TLS=1)
+ *     -n           poll: call handleFTP() in a loop without waitFTP()
+ */
+
+#include "host.h"
+
+#include <signal.h>
+
+#if FTP_ENABLE_TLS
+#include "ftp_cert.h"
+#endif
+
+class FilePrint : public Print{
+public:
+  explicit FilePrint( FILE *f ) : f( f ){}
+  size_t write( uint8_t c ){ return fputc( c, f ) == EOF ? 0 : 1; }
+  size_t write( const uint8_t *b, size_t n ){ return fwrite( b, 1, n, f ); }
+private:
+  FILE *f;
+};
+
+static volatile sig_atomic_t quit;
+
+static void onSignal( int ){
+  quit = 1;
+}
+
+static void usage(){
+  fprintf( stderr, "usage: ftp_host [-p port] [-d port] [-u user] [-w pass] [-b bytes] [-r rate] [-g rate]\n"
+    "                [-z] [-s] [-o file] [-t trace] [-T] [-n]\n" );
+  exit( 2 );
+}
+
+int main( int argc, char **argv ){
+  uint16_t ctrlPort = 2121, pasvPort = 50009;
+  const char *user = NULL, *pass = "";
+  unsigned long size = 1 << 20, rate = 0, globalRate = 0;
+  bool compress = false, snap = false, tls = false, poll = false;
+  const char *roPath = NULL, *tracePath = NULL;
+  int c;
+  while(( c = getopt( argc, argv, "p:d:u:w:b:r:g:zso:t:Tn" )) != -1 ){
+    switch( c ){
+      case 'p': ctrlPort = atoi( optarg ); break;
+      case 'd': pasvPort = atoi( optarg ); break;
+      case 'u': user = optarg; break;
+      case 'w': pass = optarg; break;
+      case 'b': size = strtoul( optarg, NULL, 10 ); break;
+      case 'r': rate = strtoul( optarg, NULL, 10 ); break;
+      case 'g': globalRate = strtoul( optarg, NULL, 10 ); break;
+      case 'z': compress = true; break;
+      case 's': snap = true; break;
+      case 'o': roPath = optarg; break;
+      case 't': tracePath = optarg; break;
+      case 'T': tls = true; break;
+      case 'n': poll = true; break;
+      default: usage();
+    }
+  }
+  signal( SIGPIPE, SIG_IGN );
+  signal( SIGINT, onSignal );
+  signal( SIGTERM, onSignal );
+
+  static FtpServer srv( ctrlPort, pasvPort );
+  std::vector<unsigned char> buffer( size );
+  if( ! ( user == NULL ? srv.begin( buffer.data(), buffer.size() )
+                        : srv.begin( user, pass, buffer.data(), buffer.size() ))){
+    fprintf( stderr, "ftp_host: user name or password too long\n" );
+    return 1;
+  }
+  srv.setRateLimit( rate );
+  FtpServer::setGlobalRateLimit( globalRate );
+#if FTP_ENABLE_COMPRESS
+  srv.setCompression( compress );
+#else
+  if( compress )
+    fprintf( stderr, "ftp_host: built without FTP_ENABLE_COMPRESS\n" );
+#endif
+  std::vector<unsigned char> snapBuffer;
+#if FTP_ENABLE_SNAPSHOT
+  if( snap ){
+    snapBuffer.resize( size );
+    srv.setSnapshotBuffer( snapBuffer.data(), snapBuffer.size() );
+  }
+#else
+  if( snap )
+    fprintf( stderr, "ftp_host: built without FTP_ENABLE_SNAPSHOT\n" );
+#endif
+  std::vector<unsigned char> ro;
+  if( roPath != NULL ){
+    FILE *f = fopen( roPath, "rb" );
+    if( f == NULL ){
+      perror( roPath );
+      return 1;
+    }
+    unsigned char b[ 4096 ];
+    size_t n;
+    while(( n = fread( b, 1, sizeof(b), f )) > 0 )
+      ro.insert( ro.end(), b, b + n );
+    fclose( f );
+    const char *name = strrchr( roPath, '/' );
+    if( ! srv.addReadOnlyFile( name != NULL ? name + 1 : roPath, ro.data(), ro.size() )){
+      fprintf( stderr, "ftp_host: can't add %s\n", roPath );
+      return 1;
+    }
+  }
+  FILE *traceFile = NULL;
+  if( tracePath != NULL ){
+#ifdef FTP_TRACE
+    traceFile = fopen( tracePath, "wb" );
+    if( traceFile == NULL ){
+      perror( tracePath );
+      return 1;
+    }
+    static FilePrint trace( traceFile );
+    srv.setTrace( &trace );
+#else
+    fprintf( stderr, "ftp_host: -t needs a build with -DFTP_TRACE\n" );
+    return 2;
+#endif
+  }
+  if( tls ){
+#if FTP_ENABLE_TLS
+    if( ! srv.setCertificate( ftp_cert_pem, ftp_key_pem )){
+      fprintf( stderr, "ftp_host: setCertificate() failed\n" );
+      return 1;
+    }
+#else
+    fprintf( stderr, "ftp_host: -T needs a build with -DFTP_ENABLE_TLS=1\n" );
+    return 2;
+#endif
+  }
+
+  fprintf( stderr, "ftp_host: listening on 127.0.0.1:%u, passive data port %u\n", ctrlPort, pasvPort );
+  while( ! quit ){
+    if( ! poll )
+      srv.waitFTP( 1000 );
+    FTP_F_STATUS status = srv.handleFTP( 10000 );
+    if( status != F_IDLE )
+      fprintf( stderr, "ftp_host: status %d, %s %lu bytes\n", status, srv.file_name, srv.file_buffer_size );
+  }
+  if( traceFile != NULL )
+    fclose( traceFile );
+
+  return 0;
+}
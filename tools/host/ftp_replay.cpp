@@ -0,0 +1,433 @@
+/*
+ * Replay a session trace against the server on loopback
+ *
+ * Reads a trace recorded with setTrace() (see FTP_TRACE in
+ * ESP32FtpServer.h), runs a fresh server on a thread of its own, and plays
+ * the client side of the trace to it: control connections, command lines,
+ * data connections and the bytes uploaded by STOR. PORT commands are
+ * replayed with the address of a port the replayer listens on.
+ *
+ * The server starts without files and with the login of the first USER and
+ * PASS lines of the trace.
+ *
+ * Usage:
+ *   ftp_replay [options] trace
+ *     -f           as fast as possible, instead of at the recorded times
+ *     -p port      control port (2131), passive data port is port + 1
+ *     -t ms        reply timeout (2000)
+ *     -v           print every mismatch
+ *
+ * Output, one JSON line:
+ *   commands     command lines replayed
+ *   matched      commands whose reply codes are the recorded ones
+ *   exact        of them, those whose reply texts are the recorded ones
+ *                (some hold times and transfer rates)
+ *   dataBytes*   bytes of the data connections, recorded and replayed
+ *   cmdP*us      latency from sending a command to its last reply
+ *   <command>    count and latency percentiles of each command
+ *
+ * The exit status is 1 if a command got other reply codes.
+ */
+
+#include "host.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+struct Record{
+  uint8_t type;
+  uint64_t micros;                // since the first record
+  std::string payload;
+};
+
+enum{ STEP_OPEN = 0, STEP_COMMAND, STEP_CLOSE };
+
+// What the client did, with what the server answered in the trace
+struct Step{
+  int kind;
+  uint64_t micros;
+  std::string line;                     // command line
+  std::vector<std::string> replies;     // final reply lines ("ddd text")
+  bool data = false;                    // a data connection was opened
+  std::string upload;                   // bytes received by the server
+  uint64_t download = 0;                // bytes sent by the server
+};
+
+static uint64_t nowUs(){
+  struct timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Read the records of file
+//
+//  return:
+//    false if the file can't be read or is truncated
+
+static bool readTrace( const char *path, std::vector<Record> &records ){
+  FILE *f = fopen( path, "rb" );
+  if( f == NULL ){
+    perror( path );
+    return false;
+  }
+  uint8_t h[ FTP_TRACE_HEADER_SIZE ];
+  uint64_t base = 0;
+  uint32_t previous = 0;
+  bool ok = true;
+  while( fread( h, 1, sizeof(h), f ) == sizeof(h) ){
+    Record r;
+    r.type = h[0];
+    uint32_t t = h[1] | h[2] << 8 | h[3] << 16 | (uint32_t) h[4] << 24;
+    // the 32 bits microsecond stamps wrap after 71 minutes
+    if( t < previous )
+      base += (uint64_t) 1 << 32;
+    previous = t;
+    r.micros = base + t;
+    uint16_t length = h[5] | h[6] << 8;
+    r.payload.resize( length );
+    if( length > 0 && fread( &r.payload[0], 1, length, f ) != length ){
+      ok = false;
+      break;
+    }
+    if( r.type > T_DATA_CLOSE ){
+      ok = false;
+      break;
+    }
+    records.push_back( r );
+  }
+  fclose( f );
+  if( ! ok )
+    fprintf( stderr, "ftp_replay: %s is truncated or not a trace\n", path );
+  return ok;
+}
+
+static bool isFinal( const std::string &line ){
+  return line.size() >= 3 && isdigit( line[0] ) && isdigit( line[1] ) && isdigit( line[2] )
+    && ( line.size() == 3 || line[3] == ' ' );
+}
+
+static void makeSteps( const std::vector<Record> &records, std::vector<Step> &steps ){
+  for( size_t i = 0; i < records.size(); i++ ){
+    const Record &r = records[ i ];
+    if( r.type == T_CTRL_OPEN || r.type == T_CTRL_IN || r.type == T_CTRL_CLOSE ){
+      Step s;
+      s.kind = r.type == T_CTRL_OPEN ? STEP_OPEN : r.type == T_CTRL_IN ? STEP_COMMAND : STEP_CLOSE;
+      s.micros = r.micros;
+      s.line = r.payload;
+      steps.push_back( s );
+      continue;
+    }
+    if( steps.empty() )
+      continue;
+    Step &s = steps.back();
+    if( r.type == T_CTRL_OUT && isFinal( r.payload ))
+      s.replies.push_back( r.payload );
+    else if( r.type == T_DATA_OPEN )
+      s.data = true;
+    else if( r.type == T_DATA_IN )
+      s.upload += r.payload;
+    else if( r.type == T_DATA_OUT )
+      s.download += r.payload.size();
+  }
+}
+
+// Client side of the replay
+class Replayer{
+public:
+  Replayer( uint16_t port, int timeout, bool verbose )
+    : port( port ), timeout( timeout ), verbose( verbose ), ctrl( -1 ), listening( -1 ), pasvPort( 0 ){}
+  ~Replayer(){
+    closeCtrl();
+    if( listening >= 0 )
+      close( listening );
+  }
+
+  int commands = 0, matched = 0, exact = 0;
+  uint64_t bytesRecorded = 0, bytesReplayed = 0;
+  std::vector<uint32_t> latency;
+  std::map<std::string, std::vector<uint32_t> > byCommand;
+
+  void play( const Step &s ){
+    if( s.kind == STEP_CLOSE ){
+      closeCtrl();
+      return;
+    }
+    if( s.kind == STEP_OPEN ){
+      closeCtrl();
+      ctrl = connectTo( port );
+      std::vector<std::string> got;
+      readReplies( s.replies.size(), got, NULL );
+      return;
+    }
+    if( ctrl < 0 )
+      return;
+
+    std::string line = s.line;
+    std::string verb = line.substr( 0, line.find( ' ' ));
+    for( size_t i = 0; i < verb.size(); i++ )
+      verb[ i ] = toupper( verb[ i ] );
+    if( verb == "PORT" && ! listenData( line ))
+      return;
+
+    int fd = -1;
+    if( s.data && listening < 0 )
+      fd = connectTo( pasvPort );
+    bytesRecorded += s.upload.size() + s.download;
+
+    uint64_t begin = nowUs();
+    line += "\r\n";
+    if( ::send( ctrl, line.data(), line.size(), MSG_NOSIGNAL ) != (ssize_t) line.size() ){
+      closeCtrl();
+      return;
+    }
+    std::vector<std::string> got;
+    if( s.data ){
+      readReplies( 1, got, NULL );
+      if( ! got.empty() && got[0][0] == '1' )
+        transfer( fd, s );
+      else if( fd >= 0 )
+        close( fd );
+    }
+    uint64_t end = nowUs();
+    if( s.replies.size() > got.size() )
+      readReplies( s.replies.size() - got.size(), got, &end );
+
+    if( verb == "PASV" ){
+      // the next data connection goes to the port given
+      if( listening >= 0 )
+        close( listening );
+      listening = -1;
+      if( ! got.empty() && got[0].compare( 0, 3, "227" ) == 0 )
+        pasvPort = parsePasv( got[0] );
+    }
+
+    commands++;
+    bool codes = got.size() == s.replies.size();
+    bool texts = codes;
+    for( size_t i = 0; codes && i < got.size(); i++ ){
+      codes = got[ i ].compare( 0, 3, s.replies[ i ], 0, 3 ) == 0;
+      texts = texts && got[ i ] == s.replies[ i ];
+    }
+    if( codes ){
+      matched++;
+      if( texts )
+        exact++;
+      uint32_t us = (uint32_t)( end - begin );
+      latency.push_back( us );
+      byCommand[ verb ].push_back( us );
+    }else
+    if( verbose || commands - matched <= 10 ){
+      fprintf( stderr, "ftp_replay: %s: expected", s.line.c_str() );
+      for( size_t i = 0; i < s.replies.size(); i++ )
+        fprintf( stderr, " [%s]", s.replies[ i ].c_str() );
+      fprintf( stderr, ", got" );
+      for( size_t i = 0; i < got.size(); i++ )
+        fprintf( stderr, " [%s]", got[ i ].c_str() );
+      fprintf( stderr, "\n" );
+    }
+  }
+
+private:
+  uint16_t port;
+  int timeout;
+  bool verbose;
+  int ctrl;
+  int listening;                  // for the data connections after PORT
+  uint16_t pasvPort;
+  std::string in;
+
+  static int connectTo( uint16_t port ){
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in a;
+    memset( &a, 0, sizeof(a) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    a.sin_port = htons( port );
+    if( fd >= 0 && connect( fd, (struct sockaddr*) &a, sizeof(a) ) < 0 ){
+      close( fd );
+      fd = -1;
+    }
+    return fd;
+  }
+
+  static uint16_t parsePasv( const std::string &reply ){
+    unsigned int h[ 6 ];
+    size_t p = reply.find( '(' );
+    if( p == std::string::npos
+      || sscanf( reply.c_str() + p + 1, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5] ) != 6 )
+      return 0;
+    return h[4] << 8 | h[5];
+  }
+
+  void closeCtrl(){
+    if( ctrl >= 0 )
+      close( ctrl );
+    ctrl = -1;
+    in.clear();
+  }
+
+  // Replace the address of the PORT line by the one of a new listening port
+  bool listenData( std::string &line ){
+    if( listening >= 0 )
+      close( listening );
+    listening = socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in a;
+    memset( &a, 0, sizeof(a) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t len = sizeof(a);
+    if( listening < 0 || bind( listening, (struct sockaddr*) &a, sizeof(a) ) < 0 || listen( listening, 1 ) < 0
+      || getsockname( listening, (struct sockaddr*) &a, &len ) < 0 )
+      return false;
+    uint16_t p = ntohs( a.sin_port );
+    char b[ 64 ];
+    snprintf( b, sizeof(b), "PORT 127,0,0,1,%u,%u", p >> 8, p & 255 );
+    line = b;
+    return true;
+  }
+
+  // Read count final replies, or as many as come within the timeout. The
+  // time of the last one goes to *end.
+  void readReplies( size_t count, std::vector<std::string> &got, uint64_t *end ){
+    size_t wanted = got.size() + count;
+    while( got.size() < wanted ){
+      size_t eol = in.find( '\n' );
+      if( eol == std::string::npos ){
+        char b[ 512 ];
+        struct pollfd p = { ctrl, POLLIN, 0 };
+        int r = ctrl >= 0 && poll( &p, 1, timeout ) > 0 ? recv( ctrl, b, sizeof(b), 0 ) : -1;
+        if( r <= 0 )
+          return;
+        in.append( b, r );
+        continue;
+      }
+      std::string line = in.substr( 0, eol );
+      in.erase( 0, eol + 1 );
+      if( ! line.empty() && line[ line.size() - 1 ] == '\r' )
+        line.erase( line.size() - 1 );
+      if( isFinal( line )){
+        got.push_back( line );
+        if( end != NULL )
+          *end = nowUs();
+      }
+    }
+  }
+
+  // Data connection of a transfer: send the upload, or read until the end
+  void transfer( int fd, const Step &s ){
+    if( listening >= 0 ){
+      struct pollfd p = { listening, POLLIN, 0 };
+      fd = poll( &p, 1, timeout ) > 0 ? accept( listening, NULL, NULL ) : -1;
+      close( listening );
+      listening = -1;
+    }
+    if( fd < 0 )
+      return;
+    if( ! s.upload.empty() ){
+      size_t sent = 0;
+      while( sent < s.upload.size() ){
+        ssize_t r = ::send( fd, s.upload.data() + sent, s.upload.size() - sent, MSG_NOSIGNAL );
+        if( r <= 0 )
+          break;
+        sent += r;
+      }
+      bytesReplayed += sent;
+    }else{
+      char b[ 16384 ];
+      for(;;){
+        struct pollfd p = { fd, POLLIN, 0 };
+        int r = poll( &p, 1, timeout ) > 0 ? recv( fd, b, sizeof(b), 0 ) : -1;
+        if( r <= 0 )
+          break;
+        bytesReplayed += r;
+      }
+    }
+    close( fd );
+  }
+};
+
+static void usage(){
+  fprintf( stderr, "usage: ftp_replay [-f] [-p port] [-t ms] [-v] trace\n" );
+  exit( 2 );
+}
+
+int main( int argc, char **argv ){
+  bool fast = false, verbose = false;
+  uint16_t port = 2131;
+  int timeout = 2000;
+  int c;
+  while(( c = getopt( argc, argv, "fp:t:v" )) != -1 ){
+    switch( c ){
+      case 'f': fast = true; break;
+      case 'p': port = atoi( optarg ); break;
+      case 't': timeout = atoi( optarg ); break;
+      case 'v': verbose = true; break;
+      default: usage();
+    }
+  }
+  if( optind != argc - 1 )
+    usage();
+  signal( SIGPIPE, SIG_IGN );
+
+  std::vector<Record> records;
+  if( ! readTrace( argv[ optind ], records ))
+    return 2;
+  std::vector<Step> steps;
+  makeSteps( records, steps );
+
+  // login of the trace
+  std::string user = "anonymous", pass;
+  for( size_t i = 0; i < steps.size(); i++ ){
+    const std::string &line = steps[ i ].line;
+    if( strncasecmp( line.c_str(), "USER ", 5 ) == 0 && user == "anonymous" )
+      user = line.substr( 5 );
+    if( strncasecmp( line.c_str(), "PASS ", 5 ) == 0 ){
+      pass = line.substr( 5 );
+      break;
+    }
+  }
+
+  static unsigned char buffer[ 1 << 20 ];
+  static FtpServer srv( port, port + 1 );
+  if( ! srv.begin( user.c_str(), pass.c_str(), buffer, sizeof(buffer) )){
+    fprintf( stderr, "ftp_replay: login of the trace too long\n" );
+    return 2;
+  }
+  HostLoop loop( srv );
+
+  Replayer replayer( port, timeout, verbose );
+  uint64_t begin = nowUs();
+  uint64_t first = steps.empty() ? 0 : steps[0].micros;
+  for( size_t i = 0; i < steps.size(); i++ ){
+    if( ! fast ){
+      uint64_t at = begin + steps[ i ].micros - first;
+      uint64_t now = nowUs();
+      if( at > now )
+        usleep( at - now );
+    }
+    replayer.play( steps[ i ] );
+  }
+  double seconds = ( nowUs() - begin ) / 1e6;
+  loop.stop();
+
+  std::vector<uint32_t> &l = replayer.latency;
+  printf( "{\"records\":%zu,\"seconds\":%.3f,\"commands\":%d,\"matched\":%d,\"exact\":%d,"
+    "\"dataBytesRecorded\":%llu,\"dataBytesReplayed\":%llu,\"cmdP50us\":%u,\"cmdP99us\":%u,\"cmdP999us\":%u",
+    records.size(), seconds, replayer.commands, replayer.matched, replayer.exact,
+    (unsigned long long) replayer.bytesRecorded, (unsigned long long) replayer.bytesReplayed,
+    percentile( l, 500 ), percentile( l, 990 ), percentile( l, 999 ));
+  std::map<std::string, std::vector<uint32_t> >::iterator it;
+  for( it = replayer.byCommand.begin(); it != replayer.byCommand.end(); ++it )
+    printf( ",\"%s\":{\"count\":%zu,\"p50us\":%u,\"p99us\":%u}", it->first.c_str(), it->second.size(),
+      percentile( it->second, 500 ), percentile( it->second, 990 ));
+  printf( "}\n" );
+
+  return replayer.matched == replayer.commands ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * Arduino core functions of the host build
+ */
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+HostSerial Serial;
+HostWiFi WiFi;
+
+static uint64_t monotonicMicros(){
+  struct timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// time since the start of the program, as on the device
+static const uint64_t microsStart = monotonicMicros();
+
+unsigned long millis(){
+  return (unsigned long)(( monotonicMicros() - microsStart ) / 1000 );
+}
+
+unsigned long micros(){
+  return (unsigned long)( monotonicMicros() - microsStart );
+}
+
+void delay( unsigned long ms ){
+  usleep( ms * 1000 );
+}
+
+void yield(){
+}
+
+bool getLocalTime( struct tm *info, uint32_t ms ){
+  (void) ms;
+  time_t now = time( NULL );
+  return localtime_r( &now, info ) != NULL;
+}
@@ -0,0 +1,85 @@
+/*
+ * Host harness of the FTP server
+ *
+ * The server is built on a Linux host with the stand-ins of include/ for
+ * the Arduino core, WiFiClient and WiFiServer, which use loopback sockets.
+ * Tests and benchmarks run it on a thread of their own with HostLoop and
+ * talk to it with FtpClient (ftp_client.h). See build.sh.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "ESP32FtpServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Run servers on a thread until stop(). A single server sleeps in
+// waitFTP() between calls of handleFTP(budget_us); several are served in
+// turn, sleeping 1 ms when none of them has work.
+
+class HostLoop{
+public:
+  explicit HostLoop( FtpServer &srv, uint32_t budget_us = 10000 ){
+    servers.push_back( &srv );
+    start( budget_us );
+  }
+  explicit HostLoop( const std::vector<FtpServer*> &srvs, uint32_t budget_us = 1000 ) : servers( srvs ){
+    start( budget_us );
+  }
+  ~HostLoop(){ stop(); }
+
+  void stop(){
+    quit = true;
+    if( thread.joinable() )
+      thread.join();
+  }
+
+  // number of times handleFTP() returned status
+  int count( FTP_F_STATUS status ) const { return events[ status ]; }
+
+private:
+  std::vector<FtpServer*> servers;
+  std::atomic<bool> quit;
+  std::atomic<int> events[ F_RENAMED + 1 ];
+  std::thread thread;
+
+  void start( uint32_t budget_us ){
+    quit = false;
+    for( int i = 0; i <= F_RENAMED; i++ )
+      events[ i ] = 0;
+    thread = std::thread( [ this, budget_us ](){
+      while( ! quit ){
+        if( servers.size() == 1 ){
+          servers[0]->waitFTP( 10 );
+          events[ servers[0]->handleFTP( budget_us ) ]++;
+          continue;
+        }
+        boolean work = false;
+        for( size_t i = 0; i < servers.size(); i++ ){
+          events[ servers[i]->handleFTP( budget_us ) ]++;
+          work = servers[i]->waitFTP( 0 ) || work;
+        }
+        if( ! work )
+          usleep( 1000 );
+      }
+    });
+  }
+};
+
+// Value at permille of v (sorted by the call), 0 if v is empty
+
+inline uint32_t percentile( std::vector<uint32_t> &v, uint32_t permille ){
+  if( v.empty() )
+    return 0;
+  std::sort( v.begin(), v.end() );
+  size_t rank = ( v.size() * permille + 999 ) / 1000;
+  if( rank > 0 )
+    rank--;
+  return v[ std::min( rank, v.size() - 1 ) ];
+}
+
+#endif // HOST_H
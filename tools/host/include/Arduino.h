@@ -0,0 +1,78 @@
+/*
+ * Stand-in of the Arduino core for the host build of the FTP server
+ *
+ * Only what ESP32FtpServer.cpp uses. None of it allocates memory, so that
+ * the allocations counted by test_alloc are those of the server.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef bool boolean;
+
+class Print{
+public:
+  virtual ~Print(){}
+  virtual size_t write( uint8_t c ) = 0;
+  virtual size_t write( const uint8_t *b, size_t n ){
+    for( size_t i = 0; i < n; i++ )
+      write( b[i] );
+    return n;
+  }
+
+  size_t print( const char *s ){ return write((const uint8_t*) s, strlen( s )); }
+  size_t print( char c ){ return write((uint8_t) c ); }
+  size_t print( unsigned long v ){ return printf( "%lu", v ); }
+  size_t print( int v ){ return printf( "%d", v ); }
+  size_t println(){ return print( "\r\n" ); }
+  template< typename T > size_t println( T v ){ size_t n = print( v ); return n + println(); }
+
+  size_t printf( const char *format, ... ) __attribute__ ((format (printf, 2, 3))){
+    char line[ 512 ];
+    va_list args;
+    va_start( args, format );
+    int n = vsnprintf( line, sizeof(line), format, args );
+    va_end( args );
+    if( n < 0 )
+      return 0;
+    return print( line );
+  }
+};
+
+// Arduino String, reduced to what begin() takes
+class String{
+public:
+  String( const char *s = "" ) : s( s ){}
+  const char *c_str() const { return s; }
+  unsigned int length() const { return strlen( s ); }
+private:
+  const char *s;
+};
+
+// Serial goes to stderr
+class HostSerial : public Print{
+public:
+  void begin( unsigned long ){}
+  size_t write( uint8_t c ){ return fputc( c, stderr ) == EOF ? 0 : 1; }
+  size_t write( const uint8_t *b, size_t n ){ return fwrite( b, 1, n, stderr ); }
+};
+
+extern HostSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay( unsigned long ms );
+void yield();
+bool getLocalTime( struct tm *info, uint32_t ms = 5000 );
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,24 @@
+// Stand-in of IPAddress for the host build: 4 bytes in network order
+
+#ifndef HOST_IPADDRESS_H
+#define HOST_IPADDRESS_H
+
+#include <stdint.h>
+
+class IPAddress{
+public:
+  IPAddress() : addr( 0 ){}
+  IPAddress( uint8_t a, uint8_t b, uint8_t c, uint8_t d )
+    : addr( a | b << 8 | c << 16 | (uint32_t) d << 24 ){}
+  IPAddress( uint32_t address ) : addr( address ){}
+
+  operator uint32_t() const { return addr; }
+  uint8_t operator[]( int i ) const { return ( addr >> ( 8 * i )) & 0xff; }
+  bool operator==( const IPAddress &other ) const { return addr == other.addr; }
+  bool operator!=( const IPAddress &other ) const { return addr != other.addr; }
+
+private:
+  uint32_t addr;
+};
+
+#endif // HOST_IPADDRESS_H
@@ -0,0 +1,16 @@
+// Stand-in of the WiFi object for the host build, on the loopback interface
+
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+
+class HostWiFi{
+public:
+  IPAddress localIP(){ return IPAddress( 127, 0, 0, 1 ); }
+};
+
+extern HostWiFi WiFi;
+
+#endif // HOST_WIFI_H
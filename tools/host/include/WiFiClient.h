@@ -0,0 +1,88 @@
+/*
+ * Stand-in of WiFiClient for the host build: a loopback TCP socket
+ *
+ * Copies share the socket, which only stop() closes, as the server always
+ * does before dropping a connection. Reading and writing block like the
+ * ESP32 client does.
+ */
+
+#ifndef HOST_WIFICLIENT_H
+#define HOST_WIFICLIENT_H
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+class WiFiClient : public Print{
+public:
+  WiFiClient() : sock( -1 ){}
+  explicit WiFiClient( int fd ) : sock( fd ){
+    int one = 1;
+    setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  }
+
+  int fd() const { return sock; }
+  operator bool() const { return sock >= 0; }
+
+  int available(){
+    int n = 0;
+    if( sock < 0 || ioctl( sock, FIONREAD, &n ) < 0 )
+      return 0;
+    return n;
+  }
+
+  uint8_t connected(){
+    if( sock < 0 )
+      return 0;
+    char c;
+    int r = recv( sock, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    if( r == 0 )
+      return 0;
+    if( r < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+      return 0;
+    return 1;
+  }
+
+  void stop(){
+    if( sock >= 0 )
+      close( sock );
+    sock = -1;
+  }
+
+  int read(){
+    uint8_t c;
+    return read( &c, 1 ) == 1 ? c : -1;
+  }
+  int read( uint8_t *b, size_t n ){
+    return sock < 0 ? -1 : recv( sock, b, n, 0 );
+  }
+
+  size_t write( uint8_t c ){ return write( &c, 1 ); }
+  size_t write( const uint8_t *b, size_t n ){
+    size_t sent = 0;
+    while( sock >= 0 && sent < n ){
+      int r = send( sock, b + sent, n - sent, MSG_NOSIGNAL );
+      if( r <= 0 )
+        break;
+      sent += r;
+    }
+    return sent;
+  }
+
+  IPAddress remoteIP(){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if( sock < 0 || getpeername( sock, (struct sockaddr*) &addr, &len ) < 0 )
+      return IPAddress();
+    return IPAddress((uint32_t) addr.sin_addr.s_addr );
+  }
+
+private:
+  int sock;
+};
+
+#endif // HOST_WIFICLIENT_H
@@ -0,0 +1,69 @@
+/*
+ * Stand-in of WiFiServer for the host build: a non-blocking listening
+ * socket on the loopback interface
+ */
+
+#ifndef HOST_WIFISERVER_H
+#define HOST_WIFISERVER_H
+
+#include "WiFiClient.h"
+
+#include <fcntl.h>
+
+class WiFiServer{
+public:
+  WiFiServer( uint16_t port = 80, uint8_t max_clients = 4 )
+    : port( port ), listening( -1 ), pending( -1 ){ (void) max_clients; }
+
+  void begin( uint16_t p = 0 ){
+    if( p != 0 )
+      port = p;
+    listening = socket( AF_INET, SOCK_STREAM, 0 );
+    int one = 1;
+    setsockopt( listening, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( bind( listening, (struct sockaddr*) &addr, sizeof(addr) ) < 0 || listen( listening, 8 ) < 0 ){
+      fprintf( stderr, "WiFiServer: port %u: %s\n", port, strerror( errno ));
+      close( listening );
+      listening = -1;
+      return;
+    }
+    fcntl( listening, F_SETFL, O_NONBLOCK );
+  }
+
+  void end(){
+    if( pending >= 0 )
+      close( pending );
+    if( listening >= 0 )
+      close( listening );
+    pending = listening = -1;
+  }
+
+  bool hasClient(){
+    if( pending < 0 && listening >= 0 )
+      pending = accept( listening, NULL, NULL );
+    return pending >= 0;
+  }
+
+  WiFiClient available(){
+    if( ! hasClient() )
+      return WiFiClient();
+    WiFiClient client( pending );
+    pending = -1;
+    return client;
+  }
+
+  // Listening socket, for waitFTP() built with FTP_WAIT_EPOLL
+  int fd() const { return listening; }
+
+private:
+  uint16_t port;
+  int listening;
+  int pending;                    // accepted by hasClient(), not yet taken
+};
+
+#endif // HOST_WIFISERVER_H
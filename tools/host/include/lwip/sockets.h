@@ -0,0 +1,14 @@
+// Stand-in of the lwIP socket API for the host build: the POSIX one
+
+#ifndef HOST_LWIP_SOCKETS_H
+#define HOST_LWIP_SOCKETS_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif // HOST_LWIP_SOCKETS_H
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Run the host tests built by build.sh
+#
+# Usage:
+#   tools/host/run_tests.sh [build directory]      (tools/host/build)
+#
+
+here=$(cd "$(dirname "$0")" && pwd)
+out=${1:-"$here/build"}
+failed=0
+
+# record a load run, then replay the trace
+trace="$out/replay_test.trace"
+"$out/ftp_host" -p 2141 -d 2142 -u user -w pass -t "$trace" 2>/dev/null &
+pid=$!
+sleep 0.2
+"$out/ftp_load" -p 2141 -u user -w pass -c 1 -n 50 -m list=1,size=2,retr=4,stor=2,dele=1 127.0.0.1 >/dev/null
+kill $pid
+wait $pid
+if "$out/ftp_replay" -f -p 2143 "$trace"; then
+  echo "PASS replay"
+else
+  echo "FAIL replay"
+  failed=1
+fi
+
+"$out/test_rate" || failed=1
+"$out/test_alloc" || failed=1
+"$out/test_snapshot" || failed=1
+
+exit $failed
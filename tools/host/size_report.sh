@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Compare the size of the server built with every optional part disabled
+# (minimal) and with all of them (full): text, data and bss of the objects
+# compiled with -Os for the host, and sizeof(FtpServer). The host numbers are
+# not those of the ESP32, but the difference between the two builds is close.
+#
+# Usage:
+#   tools/host/size_report.sh [output directory]      (tools/host/build)
+#
+# CXX and SIZE are taken from the environment.
+#
+
+here=$(cd "$(dirname "$0")" && pwd)
+src="$here/../../src"
+out=${1:-"$here/build"}
+CXX=${CXX:-g++}
+SIZE=${SIZE:-size}
+mkdir -p "$out" || exit 1
+
+minimal="-DFTP_ENABLE_LIST=0 -DFTP_ENABLE_MLSD=0 -DFTP_ENABLE_RENAME=0 -DFTP_ENABLE_DELETE=0
+ -DFTP_ENABLE_COMPRESS=0 -DFTP_ENABLE_SNAPSHOT=0 -DFTP_ENABLE_TAR=0"
+full="-DFTP_ENABLE_LIST=1 -DFTP_ENABLE_MLSD=1 -DFTP_ENABLE_RENAME=1 -DFTP_ENABLE_DELETE=1
+ -DFTP_ENABLE_COMPRESS=1 -DFTP_ENABLE_SNAPSHOT=1 -DFTP_ENABLE_TAR=1"
+
+# report name flags...
+report(){
+  name=$1
+  shift
+  for f in ESP32FtpServer FtpLz; do
+    $CXX -std=gnu++11 -Os -c -I"$here/include" -I"$src" "$@" -o "$out/size_${name}_$f.o" "$src/$f.cpp" || exit 1
+  done
+  printf '#include "ESP32FtpServer.h"\n#include <stdio.h>\nint main(){ printf( "%%u", (unsigned) sizeof(FtpServer) ); return 0; }\n' \
+    > "$out/size_main.cpp"
+  $CXX -std=gnu++11 -I"$here/include" -I"$src" "$@" -o "$out/size_main" "$out/size_main.cpp" || exit 1
+  $SIZE -t "$out/size_${name}_ESP32FtpServer.o" "$out/size_${name}_FtpLz.o" | tail -1 | \
+    ( read text data bss dec rest; printf "%-8s %8s %6s %6s %8s %10s\n" "$name" "$text" "$data" "$bss" "$dec" "$("$out/size_main")" )
+}
+
+printf "%-8s %8s %6s %6s %8s %10s\n" build text data bss total "sizeof(FtpServer)"
+report minimal $minimal
+report full $full
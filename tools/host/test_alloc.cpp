@@ -0,0 +1,93 @@
+/*
+ * Test that the server doesn't allocate memory while it serves a session
+ *
+ * malloc, calloc and realloc (and so new) are replaced by counting ones,
+ * which count the calls of the server thread only. After a first session
+ * that warms up the C library (localtime, stdio...), login, LIST, STOR,
+ * RETR and DELE are run again, with and without compression, and must not
+ * allocate. Built by build.sh (without sanitizers, which replace malloc
+ * too), run by run_tests.sh.
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+extern "C" void *__libc_malloc( size_t n );
+extern "C" void *__libc_calloc( size_t n, size_t size );
+extern "C" void *__libc_realloc( void *p, size_t n );
+
+static std::atomic<bool> armed;
+static std::atomic<unsigned long> allocations;
+static __thread bool serverThread;
+
+extern "C" void *malloc( size_t n ){
+  if( serverThread && armed )
+    allocations++;
+  return __libc_malloc( n );
+}
+
+extern "C" void *calloc( size_t n, size_t size ){
+  if( serverThread && armed )
+    allocations++;
+  return __libc_calloc( n, size );
+}
+
+extern "C" void *realloc( void *p, size_t n ){
+  if( serverThread && armed )
+    allocations++;
+  return __libc_realloc( p, n );
+}
+
+static int failures;
+
+// login, LIST, STOR, RETR and DELE
+static bool session(){
+  FtpClient ftp( 2161 );
+  std::string data( 20000, 'a' ), got, list;
+  for( size_t i = 0; i < data.size(); i++ )
+    data[i] = i * 13 / 7;
+  return ftp.login( "user", "pass" )
+    && ftp.stor( "/a.bin", data ) == 226
+    && ftp.receive( "LIST", &list ) == 226 && list.find( "a.bin" ) != std::string::npos
+    && ftp.retr( "/a.bin", &got ) == 226 && got == data
+    && ftp.command( "DELE /a.bin" ) == 250
+    && ftp.command( "QUIT" ) == 221;
+}
+
+static void check( const char *name ){
+  armed = true;
+  allocations = 0;
+  bool ok = session();
+  armed = false;
+  ok = ok && allocations == 0;
+  printf( "%s alloc %s: %lu allocations\n", ok ? "PASS" : "FAIL", name, (unsigned long) allocations );
+  if( ! ok )
+    failures++;
+}
+
+int main(){
+  static unsigned char buffer[ 65536 ];
+  static FtpServer srv( 2161, 2162 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+
+  std::atomic<bool> quit( false );
+  std::thread loop( [ &quit ](){
+    serverThread = true;
+    while( ! quit ){
+      srv.waitFTP( 10 );
+      srv.handleFTP( 10000 );
+    }
+  });
+
+  session();
+  check( "session" );
+#if FTP_ENABLE_COMPRESS
+  srv.setCompression( true );
+  session();
+  check( "compressed session" );
+#endif
+
+  quit = true;
+  loop.join();
+  return failures > 0 ? 1 : 0;
+}
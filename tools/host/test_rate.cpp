@@ -0,0 +1,101 @@
+/*
+ * Test of the rate limits: the rates achieved by RETR against the limits
+ * configured
+ *
+ *   - a session limit alone
+ *   - the global limit with a single transfer, which gets all of it
+ *   - the global limit with three concurrent transfers of three instances,
+ *     which get a third of it each
+ *   - the global limit with a session limit below the fair share on one of
+ *     the instances
+ *
+ * A rate passes within 15 % of the one expected. Built by build.sh, run by
+ * run_tests.sh.
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#include <chrono>
+
+#define SERVERS 3
+#define FILE_SIZE 60000UL
+
+static int failures;
+
+static double now(){
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// RETR /data.bin from the server on port, rate in bytes/s written to rate,
+// 0 if the download failed
+static void download( uint16_t port, double *rate ){
+  *rate = 0;
+  FtpClient ftp( port );
+  if( ! ftp.login( "user", "pass" ))
+    return;
+  std::string got;
+  double begin = now();
+  if( ftp.retr( "/data.bin", &got ) == 226 && got.size() == FILE_SIZE )
+    *rate = got.size() / ( now() - begin );
+}
+
+static void check( const char *name, double rate, double expected ){
+  boolean ok = rate > expected * 0.85 && rate < expected * 1.15;
+  printf( "%s rate %s: %.0f bytes/s, expected %.0f\n", ok ? "PASS" : "FAIL", name, rate, expected );
+  if( ! ok )
+    failures++;
+}
+
+// Download from the first n servers at the same time
+static void concurrent( int n, double *rates ){
+  std::vector<std::thread> clients;
+  for( int i = 0; i < n; i++ )
+    clients.push_back( std::thread( download, 2151 + 2 * i, &rates[i] ));
+  for( size_t i = 0; i < clients.size(); i++ )
+    clients[i].join();
+}
+
+int main(){
+  static unsigned char buffers[ SERVERS ][ 4096 ];
+  static unsigned char contents[ FILE_SIZE ];
+  for( unsigned long i = 0; i < FILE_SIZE; i++ )
+    contents[i] = i * 7;
+
+  std::vector<FtpServer*> servers;
+  for( int i = 0; i < SERVERS; i++ ){
+    FtpServer *srv = new FtpServer( 2151 + 2 * i, 2152 + 2 * i );
+    srv->begin( "user", "pass", buffers[i], sizeof(buffers[i]) );
+    srv->addReadOnlyFile( "data.bin", contents, FILE_SIZE );
+    servers.push_back( srv );
+  }
+  HostLoop loop( servers );
+  double rates[ SERVERS ];
+
+  servers[0]->setRateLimit( 40000 );
+  concurrent( 1, rates );
+  check( "session", rates[0], 40000 );
+  servers[0]->setRateLimit( 0 );
+
+  FtpServer::setGlobalRateLimit( 90000 );
+  concurrent( 1, rates );
+  check( "global alone", rates[0], 90000 );
+  // let the share of the last transfer expire
+  usleep( 2100000 );
+
+  concurrent( 3, rates );
+  for( int i = 0; i < 3; i++ )
+    check( "global of three", rates[i], 30000 );
+  check( "global of three, total", rates[0] + rates[1] + rates[2], 90000 );
+  usleep( 2100000 );
+
+  // the share of a slower client isn't given to the others
+  servers[2]->setRateLimit( 15000 );
+  concurrent( 3, rates );
+  check( "global, first", rates[0], 30000 );
+  check( "global, second", rates[1], 30000 );
+  check( "session under the share", rates[2], 15000 );
+
+  loop.stop();
+  return failures > 0 ? 1 : 0;
+}
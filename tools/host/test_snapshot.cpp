@@ -0,0 +1,68 @@
+/*
+ * Test of the memory a snapshot costs
+ *
+ * The snapshot itself is an FTP_SNAPSHOT in the instance. The snapshot
+ * buffer, filled with a marker, must stay untouched while the snapshot
+ * shares the stored file, and get exactly the stored bytes once a STOR
+ * overwrites them; both versions must still be retrievable. A second
+ * snapshot is refused while the first is held. Built by build.sh, run by
+ * run_tests.sh.
+ */
+
+#include "host.h"
+#include "ftp_client.h"
+
+#define FILE_SIZE 20000UL
+#define MARK 0xA5
+
+static int failures;
+static unsigned char snapBuffer[ 65536 ];
+
+static void check( const char *name, bool ok ){
+  printf( "%s snapshot %s\n", ok ? "PASS" : "FAIL", name );
+  if( ! ok )
+    failures++;
+}
+
+// Bytes of the snapshot buffer written since it was marked
+static unsigned long used(){
+  unsigned long n = sizeof(snapBuffer);
+  while( n > 0 && snapBuffer[ n - 1 ] == MARK )
+    n--;
+  return n;
+}
+
+int main(){
+  static unsigned char buffer[ 65536 ];
+  static FtpServer srv( 2211, 2212 );
+  srv.begin( "user", "pass", buffer, sizeof(buffer) );
+  memset( snapBuffer, MARK, sizeof(snapBuffer) );
+  srv.setSnapshotBuffer( snapBuffer, sizeof(snapBuffer) );
+  HostLoop loop( srv );
+
+  std::string before( FILE_SIZE, 'a' ), after( FILE_SIZE, 'b' ), got;
+  for( unsigned long i = 0; i < FILE_SIZE; i++ )
+    before[i] = i * 7 % 251;
+  FtpClient ftp( 2211 );
+  ftp.login( "user", "pass" );
+  ftp.stor( "/a.bin", before );
+
+  check( "create", ftp.command( "SITE SNAP s1" ) == 200 );
+  unsigned long shared = used();
+  check( "shares the file", shared == 0 );
+  check( "single", ftp.command( "SITE SNAP s2" ) == 550 );
+
+  check( "overwrite", ftp.stor( "/a.bin", after ) == 226 );
+  unsigned long copied = used();
+  check( "copies the stored bytes", copied == FILE_SIZE && memcmp( snapBuffer, before.data(), FILE_SIZE ) == 0 );
+  check( "old version", ftp.retr( "/.snap/s1/a.bin", &got ) == 226 && got == before );
+  got.clear();
+  check( "new version", ftp.retr( "/a.bin", &got ) == 226 && got == after );
+  check( "release", ftp.command( "SITE SNAP RELEASE" ) == 200 );
+  ftp.command( "QUIT" );
+  loop.stop();
+
+  printf( "snapshot overhead: %u bytes in the instance, %lu bytes of buffer while shared, %lu once overwritten\n",
+    (unsigned) sizeof(FTP_SNAPSHOT), shared, copied );
+  return failures > 0 ? 1 : 0;
+}